@@ -0,0 +1,66 @@
+#ifndef included_arena_h_
+#define included_arena_h_
+
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Bump allocator.
+ * Objects are carved out of large blocks one after the other, and are never
+ * freed one at a time; everything goes at once when the arena is cleared or
+ * destroyed, at which point the destructors of objects which have one are
+ * run, newest first.
+ */
+struct arena {
+    static const size_t block_size = 64 * 1024;
+    std::vector<char*> blocks;
+    char* top = nullptr; // next free byte of the current block
+    size_t left = 0;     // bytes left in the current block
+    std::vector<std::pair<void*, void(*)(void*)>> finalizers;
+
+    arena() {}
+    arena(const arena&) = delete;
+    arena& operator=(const arena&) = delete;
+    ~arena() {
+        clear();
+    }
+
+    inline void* allocate(size_t size, size_t align) {
+        size_t pad = -(uintptr_t)top & (align - 1);
+        if (pad + size > left) {
+            size_t cap = size + align > block_size ? size + align : block_size;
+            top = (char*)malloc(cap);
+            if (!top) throw std::bad_alloc();
+            blocks.push_back(top);
+            left = cap;
+            pad = -(uintptr_t)top & (align - 1);
+        }
+        char* p = top + pad;
+        top = p + size;
+        left -= pad + size;
+        return p;
+    }
+
+    template<typename T, typename... Args> T* make(Args&&... args) {
+        T* t = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            finalizers.emplace_back(t, [](void* p) { static_cast<T*>(p)->~T(); });
+        }
+        return t;
+    }
+
+    void clear() {
+        for (size_t i = finalizers.size(); i > 0; --i) finalizers[i - 1].second(finalizers[i - 1].first);
+        finalizers.clear();
+        for (char* b : blocks) free(b);
+        blocks.clear();
+        top = nullptr;
+        left = 0;
+    }
+};
+
+#endif // included_arena_h_
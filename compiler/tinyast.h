@@ -6,6 +6,7 @@
 #define included_tiny_ast_h_
 
 #include <compiler/tinytokenizer.h>
+#include <arena.h>
 
 #include <map>
 
@@ -43,6 +44,11 @@ struct st_callback_table {
     virtual void cond_end(size_t id) = 0;
 };
 
+/**
+ * Syntax tree node. Nodes are allocated from the arena of the compilation
+ * (see treeify()), refer to each other by plain pointers, and are all freed
+ * together with the arena.
+ */
 struct st_t {
     virtual std::string to_string(bool terse = false) {
         return "????";
@@ -52,65 +58,11 @@ struct st_t {
     }
     virtual void exec(st_callback_table* ct) {}
     virtual void cexe(st_callback_table* ct) {}
-    virtual st_t* clone() {
-        return new st_t();
-    }
     virtual size_t ops() {
         return 1;
     }
 };
 
-struct st_c {
-    st_t* r;
-    size_t* refcnt;
-    // void alive() { printf("made st_c with ptr %p ref %zu (%p)\n", r, refcnt ? *refcnt : 0, refcnt); }
-    // void dead() { printf("deleting st_c with ptr %p ref %zu (%p)\n", r, refcnt ? *refcnt : 0, refcnt); }
-    st_c(st_t* r_in) {
-        r = r_in;
-        refcnt = (size_t*)malloc(sizeof(size_t));
-        *refcnt = 1;
-        // alive();
-    }
-    st_c(const st_c& o) {
-        r = o.r;
-        refcnt = o.refcnt;
-        (*refcnt)++;
-        // alive();
-    }
-    st_c(st_c&& o) {
-        r = o.r;
-        refcnt = o.refcnt;
-        o.r = nullptr;
-        o.refcnt = nullptr;
-        // alive();
-    }
-    st_c& operator=(const st_c& o) {
-        if (refcnt) {
-            if (!--(*refcnt)) {
-                // dead();
-                delete r;
-                delete refcnt;
-            }
-        }
-        r = o.r;
-        refcnt = o.refcnt;
-        (*refcnt)++;
-        // alive();
-        return *this;
-    }
-    ~st_c() {
-        // dead();
-        if (!refcnt) return;
-        if (!--(*refcnt)) {
-            delete r;
-            delete refcnt;
-        }
-    }
-    st_c clone() {
-        return st_c(r->clone());
-    }
-};
-
 struct pre_t: public st_t {
     std::string content;
     pre_t(const std::string& content_in) : content(content_in) {}
@@ -120,9 +72,6 @@ struct pre_t: public st_t {
     virtual void exec(st_callback_table* ct) override {
         ct->emit(content);
     }
-    virtual st_t* clone() override {
-        return new pre_t(content);
-    }
 };
 
 struct cond_t: public st_t {
@@ -147,16 +96,13 @@ struct cond_t: public st_t {
         ct->cond_end(last_id);
         last_id = 0;
     }
-    virtual st_t* clone() override {
-        return new cond_t(var, val, comparator);
-    }
 };
 
 struct value_t: public st_t {
     std::string expr;
     std::string desc;
     std::string pre;
-    std::vector<st_c> conditions;
+    std::vector<st_t*> conditions;
     int priority; // -1=heavy, -1=uninteresting, 0=normal, 1=prioritized
     static bool prioritize(const std::string& pexpr, int& p) {
         if (pexpr == "heavy") p--;
@@ -168,7 +114,7 @@ struct value_t: public st_t {
         else return pexpr == "normal";
         return true;
     }
-    value_t(const std::string& expr_in, const std::string& desc_in, int priority_in, const std::string& pre_in, std::vector<st_c> conditions_in)
+    value_t(const std::string& expr_in, const std::string& desc_in, int priority_in, const std::string& pre_in, const std::vector<st_t*>& conditions_in)
     : expr(expr_in)
     , desc(desc_in)
     , priority(priority_in)
@@ -176,50 +122,39 @@ struct value_t: public st_t {
     , conditions(conditions_in) {}
     std::string cond_str(bool terse) const {
         std::string s = "";
-        for (auto& c : conditions) s += (s == "" ? "" : ", ") + c.r->to_string(terse);
+        for (st_t* c : conditions) s += (s == "" ? "" : ", ") + c->to_string(terse);
         return s;
     }
-    std::vector<st_c> cond_clone() {
-        std::vector<st_c> cv;
-        for (auto& c : conditions) cv.push_back(c.clone());
-        return cv;
-    }
     virtual std::string to_string(bool terse) override {
         return strprintf("(%s[req: %s]; pri=%d; \"%s\" {{%s}})", expr, conditions.size() ? cond_str(terse) : "none", priority, desc, pre);
     }
     virtual void exec(st_callback_table* ct) override {
-        for (auto& c : conditions) c.r->exec(ct);
+        for (st_t* c : conditions) c->exec(ct);
         ct->branch(desc, expr, priority, pre);
         for (size_t i = conditions.size() - 1; i < conditions.size(); --i) {
-            conditions[i].r->cexe(ct);
+            conditions[i]->cexe(ct);
         }
     }
-    virtual st_t* clone() override {
-        return new value_t(expr, desc, priority, pre, cond_clone());
-    }
 };
 
 struct option_t: public st_t {
     std::string name;
-    std::vector<st_c> values;
-    option_t(const std::string& name_in, const std::vector<st_c>& values_in)
+    std::vector<st_t*> values;
+    option_t(const std::string& name_in, const std::vector<st_t*>& values_in)
     : name(name_in)
     , values(values_in) {}
     virtual std::string to_string(bool terse) override {
         std::string s = strprintf("<> %s {\n", name);
-        for (const auto& v : values) s += "\t" + v.r->to_string() + "\n";
+        for (st_t* v : values) s += "\t" + v->to_string() + "\n";
         return s + "}";
     }
     virtual void exec(st_callback_table* ct) override {
         ct->option_begin(name);
-        for (const auto& v : values) {
-            v.r->exec(ct);
+        for (st_t* v : values) {
+            v->exec(ct);
         }
         ct->option_end(name);
     }
-    virtual st_t* clone() override {
-        return new option_t(name, values);
-    }
 };
 
 } // namespace tiny
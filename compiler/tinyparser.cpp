@@ -6,43 +6,40 @@
 
 namespace tiny {
 
-std::vector<std::string> pdt;
-std::string pdts = "";
-static size_t ctr = 0;
 struct pdo {
-    pdo(const std::string& v) {
-        pdt.push_back(v);
-        ctr++;
-        printf("%s%s [%zu] {\n", pdts.c_str(), v.c_str(), ctr);
-        pdts += "  ";
+    context& c;
+    pdo(context& c_in, const std::string& v) : c(c_in) {
+        c.pdt.push_back(v);
+        c.ctr++;
+        printf("%s%s [%zu] {\n", c.pdts.c_str(), v.c_str(), c.ctr);
+        c.pdts += "  ";
     }
     ~pdo() {
-        pdts = pdts.substr(2);
-        pdt.pop_back();
-        if (pdt.size()) printf("%s} // %s\n", pdts.c_str(), pdt.back().c_str());
+        c.pdts = c.pdts.substr(2);
+        c.pdt.pop_back();
+        if (c.pdt.size()) printf("%s} // %s\n", c.pdts.c_str(), c.pdt.back().c_str());
     }
 };
 
-token_t* head = nullptr;
 inline size_t count(token_t* head, token_t* t) {
     size_t i = 0;
-    for (token_t* q = head; q && q != t; q = q->next) i++;
+    for (token_t* q = head; q && q != t; q = q->next()) i++;
     return i;
 }
 
 // std::string indent = "";
 #define try(parser) \
     /*indent += " ";*/ \
-    x = parser(s); \
+    x = parser(s, c); \
     /*indent = indent.substr(1);*/\
     if (x) {\
-        /*printf("#%zu [caching %s=%p(%s, %s)]\n", count(head, *s), x->to_string().c_str(), *s, *s ? token_type_str[(*s)->token] : "<null>", *s ? (*s)->value ?: "<nil>" : "<null>");\
+        /*printf("#%zu [caching %s=%p(%s, %s)]\n", count(c.head, *s), x->to_string().c_str(), *s, *s ? token_type_str[(*s)->token] : "<null>", *s ? (*s)->str().c_str() : "<null>");\
         printf("GOT " #parser ": %s\n", x->to_string().c_str());*/\
         return x;\
     }
-#define DEBUG_PARSER(s) //pdo __pdo(s) //printf("- %s\n", s)
+#define DEBUG_PARSER(s) //pdo __pdo(c, s) //printf("- %s\n", s)
 
-st_t* parse_expr(token_t** s) {
+st_t* parse_expr(token_t** s, context& c) {
     DEBUG_PARSER("expr");
     st_t* x;
     token_t* pcv = *s;
@@ -51,85 +48,85 @@ st_t* parse_expr(token_t** s) {
     return nullptr;
 }
 
-std::vector<st_c> parse_conditions(token_t** s);
+std::vector<st_t*> parse_conditions(token_t** s, context& c);
 
-st_t* parse_pre(token_t** s) {
+st_t* parse_pre(token_t** s, context& c) {
     // '}}' token with content
     if ((*s)->token == tok_rpre) {
-        pre_t* t = new pre_t((*s)->value);
-        *s = (*s)->next;
+        pre_t* t = c.nodes.make<pre_t>((*s)->str());
+        *s = (*s)->next();
         return t;
     }
     return nullptr;
 }
 
-st_t* parse_option(token_t** s) {
+st_t* parse_option(token_t** s, context& c) {
     // symbol lcurly [values] rcurly
     token_t* r = *s;
-    if (r->token != tok_symbol || !r->next || r->next->token != tok_lcurly || !r->next->next) return nullptr;
-    std::string option_name = r->value;
-    r = r->next->next;
-    std::vector<st_c> values;
+    if (r->token != tok_symbol || !r->next() || r->next()->token != tok_lcurly || !r->next()->next()) return nullptr;
+    std::string option_name = r->str();
+    r = r->next()->next();
+    std::vector<st_t*> values;
     while (r && r->token != tok_rcurly) {
-        st_t* v = parse_value(&r);
+        st_t* v = parse_value(&r, c);
         if (!v) {
             // we also allow pre's
-            v = parse_pre(&r);
+            v = parse_pre(&r, c);
         }
         if (!v) return nullptr;
-        values.emplace_back(v);
+        values.push_back(v);
     }
     if (r->token != tok_rcurly) return nullptr;
-    *s = r->next;
-    return new option_t(option_name, values);
+    *s = r->next();
+    return c.nodes.make<option_t>(option_name, values);
 }
 
 // options
-st_t* parse_value(token_t** s) {
+st_t* parse_value(token_t** s, context& c) {
     /*
     normal value 1(condition): "rprot";
     */
     token_t* r = *s;
     if (r->token != tok_symbol) return nullptr;
     int priority = 0;
-    while (r->next && r->token == tok_symbol && value_t::prioritize(r->value, priority)) {
-        r = r->next;
+    while (r->next() && r->token == tok_symbol && value_t::prioritize(r->str(), priority)) {
+        r = r->next();
     }
-    if (!r->next || r->token != tok_symbol || std::string("value") != r->value) return nullptr;
-    r = r->next;
-    if (!r->next || (r->token != tok_number && r->token != tok_symbol)) return nullptr;
-    std::string value = r->value;
+    if (!r->next() || r->token != tok_symbol || std::string("value") != r->str()) return nullptr;
+    r = r->next();
+    if (!r->next() || (r->token != tok_number && r->token != tok_symbol)) return nullptr;
+    std::string value = r->str();
     std::string desc = "";
     std::string pre = "";
-    std::vector<st_c> conditions;
-    r = r->next;
+    std::vector<st_t*> conditions;
+    r = r->next();
     if (r->token == tok_lparen) {
         // condition
-        r = r->next;
-        conditions = parse_conditions(&r);
+        r = r->next();
+        conditions = parse_conditions(&r, c);
         if (!r || r->token != tok_rparen) return nullptr;
-        r = r->next;
+        r = r->next();
     }
     if (r->token == tok_colon) {
-        r = r->next;
-        if (!r || !r->next || r->token != tok_string) return nullptr;
-        desc = r->value;
-        r = r->next;
+        r = r->next();
+        if (!r || !r->next() || r->token != tok_string) return nullptr;
+        desc = r->str();
+        r = r->next();
     }
-    if (r->token == tok_consumable) r = r->next;
+    if (r->token == tok_consumable) r = r->next();
     if (r->token == tok_rpre) {
-        pre = r->value;
+        pre = r->str();
     } else if (!r || r->token != tok_semicolon) return nullptr;
-    *s = r->next;
-    return new value_t(value, desc, priority, pre, conditions);
+    *s = r->next();
+    return c.nodes.make<value_t>(value, desc, priority, pre, conditions);
 }
 
-st_t* parse_condition(token_t** s) {
+st_t* parse_condition(token_t** s, context& c) {
     // var comparator expr
     token_t* r = *s;
-    if (r->token != tok_symbol || !r->next || !r->next->next) return nullptr;
-    std::string var = r->value;
-    r = r->next;
+    if (r->token != tok_symbol || !r->next() || !r->next()->next()) return nullptr;
+    std::string var = r->str();
+    r = r->next();
     switch (r->token) {
     case tok_set:
         r->token = tok_eq;
@@ -140,40 +137,37 @@ st_t* parse_condition(token_t** s) {
         return nullptr;
     }
     token_type comparator = r->token;
-    r = r->next;
+    r = r->next();
     if (r->token != tok_number && r->token != tok_symbol) return nullptr;
-    std::string val = r->value;
-    *s = r->next;
-    return new cond_t(var, val, comparator);
+    std::string val = r->str();
+    *s = r->next();
+    return c.nodes.make<cond_t>(var, val, comparator);
 }
 
-std::vector<st_c> parse_conditions(token_t** s) {
+std::vector<st_t*> parse_conditions(token_t** s, context& c) {
     // [condition] [,] [condition2...]
-    std::vector<st_c> conds;
+    std::vector<st_t*> conds;
     token_t* r = *s;
-    st_t* cond = parse_condition(&r);
+    st_t* cond = parse_condition(&r, c);
     if (!cond) return conds;
-    conds.emplace_back(cond);
+    conds.push_back(cond);
     while (r && r->token == tok_comma) {
-        r = r->next;
-        cond = parse_condition(&r);
+        r = r->next();
+        cond = parse_condition(&r, c);
         if (!cond) { conds.clear(); return conds; }
-        conds.emplace_back(cond);
+        conds.push_back(cond);
     }
     *s = r;
     return conds;
 }
 
-st_t* treeify(token_t** tokens, bool multi) {
-    head = *tokens;
+st_t* treeify(token_t** tokens, context& c, bool multi) {
+    c.head = *tokens;
     token_t* s = *tokens;
-    st_t* value = parse_expr(&s);
-    head = nullptr;
-    if ((!s || multi) && value) {
-        value = value->clone();
-    }
+    st_t* value = parse_expr(&s, c);
+    c.head = nullptr;
     if (s && !multi) {
-        throw std::runtime_error(strprintf("failed to treeify tokens around token %s", s->value ?: token_type_str[s->token]));
+        throw std::runtime_error(strprintf("failed to treeify tokens around token %s", s->value ? s->str() : token_type_str[s->token]));
         return nullptr;
     }
     if (multi) *tokens = s;
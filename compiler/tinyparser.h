@@ -12,15 +12,32 @@
 
 namespace tiny {
 
-st_t* treeify(token_t** tokens, bool multi = false);
-
-st_t* parse_ignored(token_t** s);
-
-st_t* parse_pre(token_t** s);
-st_t* parse_option(token_t** s);
+/**
+ * Parser state of one compilation: the arena its syntax tree is allocated
+ * from, and the bookkeeping of the parser trace (see DEBUG_PARSER). Nothing
+ * is shared between contexts, so compilations can run on separate threads.
+ */
+struct context {
+    arena nodes;
+    token_t* head = nullptr; // first token of the expression being parsed
+    std::vector<std::string> pdt;
+    std::string pdts = "";
+    size_t ctr = 0;
+};
+
+/**
+ * Parse the next expression from tokens (all of them, unless multi), with
+ * the nodes allocated from the context. The tree lives as long as c does.
+ */
+st_t* treeify(token_t** tokens, context& c, bool multi = false);
+
+st_t* parse_ignored(token_t** s, context& c);
+
+st_t* parse_pre(token_t** s, context& c);
+st_t* parse_option(token_t** s, context& c);
 
 // options
-st_t* parse_value(token_t** s);
+st_t* parse_value(token_t** s, context& c);
 
 } // namespace tiny
 
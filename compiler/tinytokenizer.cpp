@@ -6,10 +6,21 @@
 
 namespace tiny {
 
-token_t* tokenize(const char* s) {
-    token_t* head = nullptr;
-    token_t* tail = nullptr;
-    token_t* prev = nullptr;
+std::vector<token_t> tokenize(const char* s, size_t len) {
+    std::vector<token_t> tokens;
+    // a token starts at a character other than whitespace, and no two start
+    // at the same one, so counting those (and the end) bounds the array,
+    // which is then allocated once
+    size_t bound = 1;
+    for (size_t j = 0; j < len && s[j]; ++j) bound += s[j] != ' ' && s[j] != '\t' && s[j] != '\n';
+    tokens.reserve(bound);
+    // tail is the last token, if any; comments and consumables stay there
+    // only until the next token replaces them (or the end drops them)
+    auto tail = [&]() -> token_t* { return tokens.empty() ? nullptr : &tokens.back(); };
+    auto push = [&](token_type token, size_t line, size_t col) {
+        if (tokens.size() && (tokens.back().token == tok_consumable || tokens.back().token == tok_line_comment)) tokens.pop_back();
+        tokens.emplace_back(token, line, col);
+    };
     bool open = false;
     bool finalized = true;
     bool spaced = false;
@@ -20,7 +31,7 @@ token_t* tokenize(const char* s) {
     size_t i;
     int consumes;
     size_t line = 0, col = 0;
-    for (i = 0; s[i]; ++i) {
+    for (i = 0; i < len && s[i]; ++i) {
         if (s[i] == '\n') {
             line++;
             col = 0;
@@ -29,7 +40,7 @@ token_t* tokenize(const char* s) {
         }
         // if we are finding a character, keep reading until we find it
         if (finding) {
-            if (finding2 && (!s[i+1] || s[i+1] != finding2)) continue;
+            if (finding2 && (i + 1 == len || !s[i+1] || s[i+1] != finding2)) continue;
             if (s[i] != finding) continue;
             finding = finding2 = 0;
             open = false;
@@ -39,18 +50,16 @@ token_t* tokenize(const char* s) {
             }
             continue; // we move one extra step, or "foo" will be read in as "foo
         }
-        auto token = determine_token(s[i], i ? s[i-1] : 0, i - token_start, restrict_type, spaced ? tok_ws : tail ? tail->token : tok_undef, consumes);
+        auto token = determine_token(s[i], i ? s[i-1] : 0, i - token_start, restrict_type, spaced ? tok_ws : tail() ? tail()->token : tok_undef, consumes);
         if (consumes) {
             // we only support 1 token consumption at this point
-            tail->token = tok_consumable;
+            tail()->token = tok_consumable;
         }
         // printf("token = %s\n", token_type_str[token]);
-        if (token == tok_consumable && tail->token == tok_consumable) {
+        if (token == tok_consumable && tail() && tail()->token == tok_consumable) {
             throw std::runtime_error(strprintf("tokenization failure 0 at character '%c'", s[i]));
-            delete head;
-            return nullptr;
         }
-        if ((token == tok_hex || token == tok_bin) && tail->token == tok_number) tail->token = tok_consumable;
+        if ((token == tok_hex || token == tok_bin) && tail()->token == tok_number) tail()->token = tok_consumable;
         // if whitespace, close
         if (token == tok_ws) {
             open = false;
@@ -61,22 +70,21 @@ token_t* tokenize(const char* s) {
         }
         // if open, see if it stays open
         if (open) {
-            open = token == tail->token;
+            open = token == tail()->token;
             if (!open) restrict_type = tok_undef;
         }
         if (!open) {
-            if (tail && tail->token == tok_consumable) {
+            if (tail() && tail()->token == tok_consumable) {
                 if (token == tok_hex || token == tok_bin) {
                     restrict_type = token;
-                    delete tail;
-                    if (head == tail) head = prev;
-                    tail = prev;
+                    tokens.pop_back();
                 }
             } else if (!finalized) {
                 size_t content_start = token_start - (prefsuflen > 1) + prefsuflen;
                 size_t content_end = i - prefsuflen;
                 if (content_end < content_start) content_end = content_start;
-                tail->value = strndup(&s[content_start], content_end - content_start);
+                tail()->value = &s[content_start];
+                tail()->length = content_end - content_start;
                 prefsuflen = 0;
                 finalized = true;
             }
@@ -94,13 +102,9 @@ token_t* tokenize(const char* s) {
             case tok_symbol:
             case tok_number:
             case tok_consumable:
-                prev = tail;
                 finalized = false;
                 token_start = i;
-                tail = new token_t(token, tail);
-                tail->line = line;
-                tail->col = col;
-                if (!head) head = tail;
+                push(token, line, col);
                 open = true;
                 break;
             case tok_set:
@@ -132,47 +136,26 @@ token_t* tokenize(const char* s) {
             case tok_ge:
             case tok_ne:
             case tok_arrow:
-                if (tail && tail->token == tok_consumable) {
-                    delete tail;
-                    if (head == tail) head = prev;
-                    tail = prev;
-                }
-                prev = tail;
-                tail = new token_t(token, tail);
-                tail->line = line;
-                tail->col = col;
-                tail->value = strndup(&s[i], 1 /* misses 1 char for concat/hex/bin, but irrelevant */);
-                if (!head) head = tail;
+                push(token, line, col);
+                tail()->value = &s[i];
+                tail()->length = 1; // misses 1 char for concat/hex/bin, but irrelevant
                 break;
             case tok_ws:
                 break;
             case tok_undef:
                 throw std::runtime_error(strprintf("tokenization failure 1 at character '%c'", s[i]));
-                delete head;
-                return nullptr;
             }
         }
-        // for (auto x = head; x; x = x->next) printf(" %s", token_type_str[x->token]); printf("\n");
+        // for (const token_t& t : tokens) printf(" %s", token_type_str[t.token]); printf("\n");
     }
     if (!finalized) {
-        tail->value = strndup(&s[token_start], i-token_start);
+        tail()->value = &s[token_start];
+        tail()->length = i - token_start;
         finalized = true;
     }
-    while (head && (head->token == tok_consumable || head->token == tok_line_comment)) {
-        token_t* tmp = head;
-        head = head->next;
-        tmp->next = nullptr;
-        delete tmp;
-    }
-    for (token_t* t = head; t; t = t->next) {
-        while (t->next && (t->next->token == tok_consumable || t->next->token == tok_line_comment)) {
-            token_t* tmp = t->next;
-            t->next = tmp->next;
-            tmp->next = nullptr;
-            delete tmp;
-        }
-    }
-    return head;
+    if (tokens.size() && (tokens.back().token == tok_consumable || tokens.back().token == tok_line_comment)) tokens.pop_back();
+    tokens.emplace_back();
+    return tokens;
 }
 
 } // namespace tiny
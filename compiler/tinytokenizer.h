@@ -92,22 +92,23 @@ static const char* token_type_str[] = {
     "ws",
 };
 
+/**
+ * Token. Values are not copied: value points into the source text, which
+ * must outlive the token. Tokens live in one array (see tokenize()), which
+ * ends with a tok_undef marker.
+ */
 struct token_t {
     size_t line, col;
     token_type token = tok_undef;
-    char* value = nullptr;
-    token_t* next = nullptr;
-    token_t(token_type token_in, token_t* prev) : token(token_in) {
-        if (prev) prev->next = this;
-    }
-    token_t(token_type token_in, const char* value_in, token_t* prev) :
-    token_t(token_in, prev) {
-        value = strdup(value_in);
-    }
-    ~token_t() { if (value) free(value); if (next) delete next; }
+    const char* value = nullptr;
+    size_t length = 0;
+    token_t() {}
+    token_t(token_type token_in, size_t line_in, size_t col_in) : line(line_in), col(col_in), token(token_in) {}
+    inline std::string str() const { return std::string(value, length); }
+    // the token after this one, or nullptr if this is the last one
+    inline token_t* next() { return this[1].token == tok_undef ? nullptr : this + 1; }
     void print() {
-        printf("[%s \"%s\"]\n", token_type_str[token], value ?: "<null>");
-        if (next) next->print();
+        for (token_t* t = this; t; t = t->next()) printf("[%s \"%s\"]\n", token_type_str[t->token], t->value ? t->str().c_str() : "<null>");
     }
 };
 
@@ -188,7 +189,15 @@ inline token_type determine_token(const char c, const char p, size_t seqlen, tok
     return tok_undef;
 }
 
-token_t* tokenize(const char* s);
+/**
+ * Tokenize the len bytes at s (or up to a NUL, if there is one) in a single
+ * pass. s need not be NUL terminated, so a mapped file can be tokenized
+ * where it lies. Comments and consumed tokens are left out, and the array is
+ * terminated by a tok_undef token (so it is never empty).
+ */
+std::vector<token_t> tokenize(const char* s, size_t len);
+
+inline std::vector<token_t> tokenize(const char* s) { return tokenize(s, strlen(s)); }
 
 inline std::string indent(const char* data) {
     size_t cap = strlen(data) + 10;
@@ -0,0 +1,43 @@
+#!/bin/sh
+# wpc --update: progress carries over to an edited specification, and
+# covering arrays (wpc --strength) are refused rather than expanded in full.
+# Run from the top of the tree after building (make check).
+set -e
+wpc="$PWD/wpc"
+wpx="$PWD/wpx"
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+cd "$dir"
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+cat > old.wpc <<'SPEC'
+a { value 1; value 2; value 3; }
+b { value 1; value 2; value 3; }
+c { value 1; value 2; value 3; }
+d { value 1; value 2; value 3; }
+SPEC
+sed 's/^d .*/d { value 1; value 2; value 3; value 4; }/' old.wpc > new.wpc
+
+# a full instance keeps what was emitted, and gains the new setting's rows
+"$wpc" -s 1 old.wpc full.scd > /dev/null
+"$wpx" -n 5 full.scd > /dev/null
+"$wpc" -u full.scd new.wpc full2.scd > /dev/null
+report=$("$wpx" -r full2.scd)
+[ "$report" = "5 of 108 configurations emitted, 103 remaining" ] || fail "full update: $report"
+
+# a covering array is refused, and no output is written
+"$wpc" -s 1 -t 2 old.wpc cover.scd > /dev/null
+"$wpx" cover.scd > /dev/null
+before=$(cksum < cover.scd)
+if "$wpc" -u cover.scd new.wpc cover2.scd > out.txt 2> err.txt; then
+    fail "covering update succeeded: $(cat out.txt)"
+fi
+grep -q "covering array of strength 2" err.txt || fail "covering update: $(cat err.txt)"
+[ ! -e cover2.scd ] || fail "covering update wrote cover2.scd"
+[ "$(cksum < cover.scd)" = "$before" ] || fail "covering update changed cover.scd"
+
+echo "update: ok"
@@ -1,28 +1,144 @@
 #include "wc.h"
 
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 namespace wc {
 
-uint32_t option::id_counter = 0;
+/**
+ * Call work(c) for every c in [0, n), spread over up to threads threads which
+ * each take the next c in turn. Runs on the calling thread alone if there is
+ * only one thread or one c.
+ */
+template<typename F> static void parallel_for(size_t n, size_t threads, F work) {
+    if (threads > n) threads = n;
+    if (threads <= 1) {
+        for (size_t c = 0; c < n; ++c) work(c);
+        return;
+    }
+    std::atomic<size_t> next(0);
+    auto run = [&]() {
+        for (size_t c; (c = next++) < n; ) work(c);
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t) pool.emplace_back(run);
+    run();
+    for (std::thread& t : pool) t.join();
+}
+
+/**
+ * Bounds of the c'th of n near-equal slices of [0, size).
+ */
+static inline size_t slice(size_t size, size_t n, size_t c) {
+    return size / n * c + std::min(c, size % n);
+}
+
+/**
+ * Call work(c, lo, hi) for slices c of [0, rows) in parallel, using at most
+ * threads slices, and no more than the rows are worth.
+ */
+template<typename F> static void parallel_rows(size_t rows, size_t threads, F work) {
+    size_t n = std::max<size_t>(1, std::min(threads, rows / 16384));
+    parallel_for(n, n, [&](size_t c) { work(c, slice(rows, n, c), slice(rows, n, c + 1)); });
+}
+
+/**
+ * Penalty kernel: for rows [lo, hi) of t, add up the penalties pen[i] of the
+ * options i for which the row has the same setting as basis, store the sum as
+ * the last penalty of the row and take it off its priority.
+ *
+ * The sum is kept in 8 lanes, option i going to lane i % 8, which are folded
+ * in a fixed order at the end. The vector kernels and the scalar fallback all
+ * add up the same way, so the result does not depend on which one the CPU
+ * gets to run.
+ */
+typedef void (*penalty_kernel)(table& t, size_t lo, size_t hi, const sidx_t* basis, const float* pen);
+
+static inline void finish_penalty(table& t, size_t r, float* lanes, const sidx_t* basis, const float* pen, size_t from) {
+    const sidx_t* row = t.row(r);
+    for (size_t i = from; i < t.width; ++i) lanes[i & 7] += row[i] == basis[i] ? pen[i] : 0.f;
+    float penalty = ((lanes[0] + lanes[4]) + (lanes[2] + lanes[6])) + ((lanes[1] + lanes[5]) + (lanes[3] + lanes[7]));
+    t.last_penalty[r] = penalty;
+    t.pri[r] -= penalty;
+}
+
+static void penalize_scalar(table& t, size_t lo, size_t hi, const sidx_t* basis, const float* pen) {
+    for (size_t r = lo; r < hi; ++r) {
+        float lanes[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+        finish_penalty(t, r, lanes, basis, pen, 0);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// 8 options at a time: compare the setting indices, widen the 16-bit match
+// masks to 32 bits, and add the penalties they let through
+__attribute__((target("avx2"))) static void penalize_avx2(table& t, size_t lo, size_t hi, const sidx_t* basis, const float* pen) {
+    size_t body = t.width & ~(size_t)7;
+    for (size_t r = lo; r < hi; ++r) {
+        const sidx_t* row = t.row(r);
+        __m256 acc = _mm256_setzero_ps();
+        for (size_t i = 0; i < body; i += 8) {
+            __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(row + i)), _mm_loadu_si128((const __m128i*)(basis + i)));
+            __m256 mask = _mm256_castsi256_ps(_mm256_cvtepi16_epi32(eq));
+            acc = _mm256_add_ps(acc, _mm256_and_ps(mask, _mm256_loadu_ps(pen + i)));
+        }
+        float lanes[8];
+        _mm256_storeu_ps(lanes, acc);
+        finish_penalty(t, r, lanes, basis, pen, body);
+    }
+}
+
+__attribute__((target("sse4.1"))) static void penalize_sse4(table& t, size_t lo, size_t hi, const sidx_t* basis, const float* pen) {
+    size_t body = t.width & ~(size_t)7;
+    for (size_t r = lo; r < hi; ++r) {
+        const sidx_t* row = t.row(r);
+        __m128 acc_lo = _mm_setzero_ps(), acc_hi = _mm_setzero_ps();
+        for (size_t i = 0; i < body; i += 8) {
+            __m128i eq = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i*)(row + i)), _mm_loadu_si128((const __m128i*)(basis + i)));
+            __m128 mask_lo = _mm_castsi128_ps(_mm_cvtepi16_epi32(eq));
+            __m128 mask_hi = _mm_castsi128_ps(_mm_cvtepi16_epi32(_mm_srli_si128(eq, 8)));
+            acc_lo = _mm_add_ps(acc_lo, _mm_and_ps(mask_lo, _mm_loadu_ps(pen + i)));
+            acc_hi = _mm_add_ps(acc_hi, _mm_and_ps(mask_hi, _mm_loadu_ps(pen + i + 4)));
+        }
+        float lanes[8];
+        _mm_storeu_ps(lanes, acc_lo);
+        _mm_storeu_ps(lanes + 4, acc_hi);
+        finish_penalty(t, r, lanes, basis, pen, body);
+    }
+}
+#endif
+
+static penalty_kernel select_penalty_kernel() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return penalize_avx2;
+    if (__builtin_cpu_supports("sse4.1")) return penalize_sse4;
+#endif
+    return penalize_scalar;
+}
 
 req::req() {}
 req::req(const std::string& var_in, const std::string& val_in, tiny::token_type cond_in)
     : var(var_in)
     , val(val_in)
     , cond(cond_in) {}
-bool req::met(const std::map<std::string,std::string>& state, const std::string& x_var, const std::string& x_val) const {
-    if (x_var != var && !state.count(var)) return true; // unknown, i.e. an as yet traversed option introduces this constriction
-    bool equals = x_var == var ? x_val == val : (!state.count(var) || state.at(var) == val);
-    return cond == tiny::tok_eq ? equals : !equals;
-}
-void req::convert_we(std::vector<req*>& v, const std::vector<we::restricter*>& rest) {
+void req::convert_we(std::vector<req*>& v, const std::vector<we::restricter*>& rest, arena& a) {
     for (const auto& r : rest) {
-        v.push_back(new req(r->var, r->val, r->condition));
+        v.push_back(a.make<req>(r->var, r->val, r->condition));
     }
 }
-bool req::met(const std::map<std::string,std::string>& state, const std::vector<req*>& requirements, const std::string& x_var, const std::string& x_val) {
-    for (const auto& r : requirements) if (!r->met(state, x_var, x_val)) return false;
-    return true;
-}
 
 std::string trim_emit(const std::string& emit) {
     if (emit.length() == 0) return emit;
@@ -60,195 +176,1882 @@ setting::setting(const std::string& value_in, const std::string& emits_in, const
     , emits(trim_emit(emits_in))
     , requirements(requirements_in)
     , priority(priority_in) {}
-
-option::option() {
-    id = id_counter++;
+float setting::calc_penalty() const {
+    // base penalty
+    float penalty = 0.01;
+    // up to 0.02 extra based on how many occurrences remain
+    penalty += 0.02 * inclusions / occurrences;
+    // for pri>0, reduce penalty by (5*pri)%; for pri<0, increase it
+    penalty *= 1.0 - 0.05 * priority;
+    return penalty;
 }
+
+option::option() {}
 option::option(const std::string& name_in, const std::string& emits_in, const std::vector<setting*> settings_in)
     : name(name_in)
     , emits(trim_emit(emits_in))
-    , settings(settings_in) {
-    id = id_counter++;
-}
+    , settings(settings_in) {}
 void option::emit(size_t sidx, FILE* fp) const {
     fprintf(fp, "%s%s=%s\n%s", emits.c_str(), name.c_str(), settings.at(sidx)->value.c_str(), settings.at(sidx)->emits.c_str());
 }
 
-configuration::configuration() {}
-configuration::configuration(const std::vector<option*>& options_in, const std::map<std::string,std::string>& state_in, const std::vector<size_t>& setting_index_in, const std::vector<req*> requirements_in, option* opt, size_t sidx, std::vector<req*> reqs)
-    : options(options_in)
-    , state(state_in)
-    , setting_index(setting_index_in)
-    , requirements(requirements_in) {
-    options.push_back(opt);
-    setting_index.push_back(sidx);
-    state[opt->name] = opt->settings[sidx]->value;
-    assert(options.size() == setting_index.size());
-    for (req* r : reqs) requirements.push_back(r);
+compat_matrix::compat_matrix(const std::vector<option*>& options) {
+    std::map<std::string,size_t> index;
+    size_t count = 0;
+    for (size_t i = 0; i < options.size(); ++i) {
+        index[options[i]->name] = i;
+        base.push_back(count);
+        count += options[i]->settings.size();
+    }
+    words = (count + 63) >> 6;
+    bits.assign(count * words, ~0ULL);
+    alive.assign(words, 0);
+    for (size_t g = 0; g < count; ++g) alive[g >> 6] |= 1ULL << (g & 63);
+    for (size_t a = 0; a < options.size(); ++a) {
+        for (size_t i = 0; i < options[a]->settings.size(); ++i) {
+            size_t g = base[a] + i;
+            for (const req* r : options[a]->settings[i]->requirements) {
+                auto it = index.find(r->var);
+                if (it == index.end()) continue; // not an option; never constrains anything
+                size_t x = it->second;
+                if (x == a) {
+                    // a requirement on our own option only ever sees our own
+                    // value, and is only checked once a later option is added
+                    if (a + 1 < options.size() && !r->holds(options[a]->settings[i]->value)) alive[g >> 6] &= ~(1ULL << (g & 63));
+                    continue;
+                }
+                for (size_t j = 0; j < options[x]->settings.size(); ++j) {
+                    if (r->holds(options[x]->settings[j]->value)) continue;
+                    size_t h = base[x] + j;
+                    bits[g * words + (h >> 6)] &= ~(1ULL << (h & 63));
+                    bits[h * words + (g >> 6)] &= ~(1ULL << (g & 63));
+                }
+            }
+        }
+    }
 }
-void configuration::will_emit() {
-    for (size_t i = 0; i < options.size(); ++i) ++si(i)->inclusions;
+
+bool compat_matrix::accepts(const sidx_t* row) const {
+    for (size_t a = 0; a < base.size(); ++a) {
+        size_t g = base[a] + row[a];
+        if (!test(alive.data(), g)) return false;
+        for (size_t b = 0; b < a; ++b) if (!test(mask(g), base[b] + row[b])) return false;
+    }
+    return true;
 }
-void configuration::calc_pri() {
-    pri = 0;
-    for (size_t i = 0; i < options.size(); ++i) {
-        pri += si(i)->priority;
+
+table::table(const table& t) : width(t.width) {
+    reserve(t.rows);
+    rows = t.rows;
+    if (rows) {
+        memcpy(pri, t.pri, rows * sizeof(float));
+        memcpy(last_penalty, t.last_penalty, rows * sizeof(float));
+        memcpy(cells, t.cells, rows * width * sizeof(sidx_t));
+    }
+}
+table::table(table&& t)
+    : width(t.width), rows(t.rows), capacity(t.capacity)
+    , pri(t.pri), last_penalty(t.last_penalty), cells(t.cells)
+    , block(t.block), owned(t.owned) {
+    t.rows = t.capacity = 0;
+    t.pri = t.last_penalty = nullptr;
+    t.cells = nullptr;
+    t.block = nullptr;
+    t.owned = true;
+}
+table::~table() {
+    if (owned) free(block);
+}
+table& table::operator=(table t) {
+    std::swap(width, t.width);
+    std::swap(rows, t.rows);
+    std::swap(capacity, t.capacity);
+    std::swap(pri, t.pri);
+    std::swap(last_penalty, t.last_penalty);
+    std::swap(cells, t.cells);
+    std::swap(block, t.block);
+    std::swap(owned, t.owned);
+    return *this;
+}
+void table::attach(char* block_in, size_t rows_in, size_t capacity_in) {
+    if (owned) free(block);
+    block = block_in;
+    owned = false;
+    rows = rows_in;
+    capacity = capacity_in;
+    pri = (float*)block;
+    last_penalty = pri + capacity;
+    cells = (sidx_t*)(last_penalty + capacity);
+}
+void table::reserve(size_t n) {
+    if (n <= capacity) return;
+    if (!owned) throw std::runtime_error(strprintf("attached table cannot grow past %zu rows", capacity));
+    char* b = (char*)malloc(block_size(width, n));
+    if (!b) throw std::bad_alloc();
+    table t(width);
+    t.attach(b, rows, n);
+    t.owned = true;
+    if (rows) {
+        memcpy(t.pri, pri, rows * sizeof(float));
+        memcpy(t.last_penalty, last_penalty, rows * sizeof(float));
+        memcpy(t.cells, cells, rows * width * sizeof(sidx_t));
+    }
+    *this = std::move(t);
+}
+void table::push_back(const sidx_t* r, float pri_in, float last_penalty_in) {
+    if (rows == capacity) reserve(std::max<size_t>(16, 2 * capacity));
+    memcpy(row(rows), r, width * sizeof(sidx_t));
+    pri[rows] = pri_in;
+    last_penalty[rows] = last_penalty_in;
+    ++rows;
+}
+void table::pop_back() {
+    --rows;
+}
+void table::clear() {
+    *this = table(width);
+}
+void table::permute(const std::vector<size_t>& order) {
+    // gather into a fresh block; order[i] is the old row which becomes row i
+    table t(width);
+    t.reserve(order.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        memcpy(t.row(i), row(order[i]), width * sizeof(sidx_t));
+        t.pri[i] = pri[order[i]];
+        t.last_penalty[i] = last_penalty[order[i]];
     }
+    t.rows = order.size();
+    *this = std::move(t);
 }
-void configuration::branch(std::vector<configuration*>* config_pool, option* opt) {
-    for (size_t i = 0; i < opt->settings.size(); ++i) {
-        setting* s = opt->settings[i];
-        if (req::met(state, s->requirements) && req::met(state, requirements, opt->name, s->value)) {
-            config_pool->push_back(new configuration(options, state, setting_index, requirements, opt, i, s->requirements));
+/**
+ * Unsigned integer which orders the same way as the float f: positive floats
+ * get the sign bit set, and negative ones have all bits flipped, as larger
+ * magnitudes are smaller numbers there.
+ */
+static inline uint32_t sort_key(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u & 0x80000000 ? ~u : u | 0x80000000;
+}
+void table::sort() {
+    // LSD radix sort on the keys of pri, a byte at a time, which is stable
+    // and linear in the number of rows; a byte which all keys share is
+    // skipped
+    size_t n = size();
+    std::vector<uint32_t> keys(n), keys_next(n);
+    std::vector<size_t> order(n), order_next(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = sort_key(pri[i]);
+        order[i] = i;
+    }
+    for (unsigned shift = 0; shift < 32; shift += 8) {
+        size_t offset[256] = {0};
+        for (size_t i = 0; i < n; ++i) ++offset[(keys[i] >> shift) & 0xff];
+        if (n && offset[(keys[0] >> shift) & 0xff] == n) continue;
+        for (size_t b = 0, sum = 0; b < 256; ++b) {
+            size_t c = offset[b];
+            offset[b] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            size_t to = offset[(keys[i] >> shift) & 0xff]++;
+            keys_next[to] = keys[i];
+            order_next[to] = order[i];
         }
+        keys.swap(keys_next);
+        order.swap(order_next);
     }
+    permute(order);
 }
-void configuration::begin(std::vector<configuration*>* config_pool, option* opt) {
-    std::vector<option*> options;
-    std::map<std::string,std::string> state;
-    std::vector<size_t> setting_index;
-    std::vector<req*> requirements;
-    for (size_t i = 0; i < opt->settings.size(); ++i) {
-        config_pool->push_back(new configuration(options, state, setting_index, requirements, opt, i, opt->settings[i]->requirements));
+void table::keep_top(size_t k) {
+    if (k >= size()) return;
+    std::vector<size_t> order(size());
+    for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+    std::nth_element(order.begin(), order.begin() + k, order.end(), [this](size_t a, size_t b) { return pri[a] > pri[b]; });
+    order.resize(k);
+    permute(order);
+}
+void table::swap_rows(size_t a, size_t b) {
+    std::swap_ranges(row(a), row(a) + width, row(b));
+    std::swap(pri[a], pri[b]);
+    std::swap(last_penalty[a], last_penalty[b]);
+}
+void table::sift_down(size_t i) {
+    size_t n = size();
+    for (;;) {
+        size_t largest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && pri[l] > pri[largest]) largest = l;
+        if (r < n && pri[r] > pri[largest]) largest = r;
+        if (largest == i) return;
+        swap_rows(i, largest);
+        i = largest;
     }
 }
-std::string configuration::to_string() const {
-    std::string r = "";//"pri=" + std::to_string(pri);
-    for (size_t i = 0; i < options.size(); ++i) {
-        r += (r == "" ? "" : ", ") + options[i]->name + "=" + si(i)->value;
+void table::heapify(size_t threads) {
+    // the rows of one level of the heap root disjoint subtrees, so they can
+    // be sifted down in any order (or at once), as long as the levels below
+    // are done first; this gives the same heap as sifting one row at a time
+    size_t inner = size() / 2; // rows with children
+    size_t first = 1;
+    while (first * 2 - 1 < inner) first *= 2;
+    for (first -= 1; ; first /= 2) {
+        size_t last = std::min(2 * first + 1, inner);
+        parallel_rows(last - first, threads, [&](size_t, size_t lo, size_t hi) {
+            for (size_t i = first + lo; i < first + hi; ++i) sift_down(i);
+        });
+        if (first == 0) break;
     }
-    return r;
 }
-void configuration::penalize(const configuration& basis) {
-    // for any matching setting indices, we penalize ourselves
-    last_penalty = 0;
-    for (size_t i = 0; i < options.size(); ++i) {
-        if (setting_index[i] == basis.setting_index[i]) {
-            auto s = si(i);
-            // base penalty
-            float penalty = 0.01;
-            // up to 0.02 extra based on how many occurrences remain
-            penalty += 0.02 * s->inclusions / s->occurrences;
-            // for pri>0, reduce penalty by (5*pri)%; for pri<0, increase it
-            penalty *= 1.0 - 0.05 * s->priority;
-            last_penalty += penalty;
-            pri -= penalty;
+void table::pop_front() {
+    size_t last = size() - 1;
+    if (last) {
+        memcpy(row(0), row(last), width * sizeof(sidx_t));
+        pri[0] = pri[last];
+        last_penalty[0] = last_penalty[last];
+    }
+    pop_back();
+    sift_down(0);
+}
+
+bigcount::bigcount(uint64_t v) {
+    while (v) {
+        limbs.push_back(v & 0xffffffff);
+        v >>= 32;
+    }
+}
+bigcount& bigcount::operator+=(const bigcount& b) {
+    if (limbs.size() < b.limbs.size()) limbs.resize(b.limbs.size(), 0);
+    uint64_t carry = 0;
+    for (size_t i = 0; i < limbs.size(); ++i) {
+        carry += (uint64_t)limbs[i] + (i < b.limbs.size() ? b.limbs[i] : 0);
+        limbs[i] = carry & 0xffffffff;
+        carry >>= 32;
+        if (!carry && i >= b.limbs.size()) break;
+    }
+    if (carry) limbs.push_back(carry);
+    return *this;
+}
+bigcount bigcount::operator*(uint64_t m) const {
+    // schoolbook, one 32-bit half of m at a time
+    bigcount r;
+    for (int half = 0; half < 2; ++half) {
+        uint64_t d = half ? m >> 32 : m & 0xffffffff;
+        if (!d) continue;
+        bigcount p;
+        p.limbs.assign(half, 0);
+        uint64_t carry = 0;
+        for (uint32_t l : limbs) {
+            carry += (uint64_t)l * d;
+            p.limbs.push_back(carry & 0xffffffff);
+            carry >>= 32;
         }
+        if (carry) p.limbs.push_back(carry);
+        if (!p.limbs.empty() && p.limbs.back() == 0) p.limbs.pop_back();
+        r += p;
     }
+    return r;
 }
-void configuration::emit(FILE* fp) const {
-    for (size_t i = 0; i < options.size(); ++i) {
-        options.at(i)->emit(setting_index.at(i), fp);
+bool bigcount::fits(size_t& out) const {
+    if (limbs.size() > sizeof(size_t) / sizeof(uint32_t)) return false;
+    out = 0;
+    for (size_t i = limbs.size(); i > 0; --i) out = (out << 16 << 16) | limbs[i - 1];
+    return true;
+}
+double bigcount::to_double() const {
+    double d = 0;
+    for (size_t i = limbs.size(); i > 0; --i) d = d * 4294967296.0 + limbs[i - 1];
+    return d;
+}
+std::string bigcount::to_string() const {
+    // peel off 9 decimal digits at a time
+    std::vector<uint32_t> v = limbs;
+    std::vector<uint32_t> chunks;
+    while (!v.empty()) {
+        uint64_t rem = 0;
+        for (size_t i = v.size(); i > 0; --i) {
+            uint64_t cur = (rem << 32) | v[i - 1];
+            v[i - 1] = cur / 1000000000;
+            rem = cur % 1000000000;
+        }
+        while (!v.empty() && v.back() == 0) v.pop_back();
+        chunks.push_back(rem);
     }
+    if (chunks.empty()) return "0";
+    std::string s = std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i > 0; --i) s += strprintf("%09u", chunks[i - 1]);
+    return s;
 }
 
-void wc::replace_config(std::vector<configuration*>* new_config) {
-    for (configuration* c : *configurations) delete c;
-    delete configurations;
-    configurations = new_config;
-}
+struct sidx_key_hash {
+    size_t operator()(const std::vector<sidx_t>& key) const {
+        uint64_t h = 0xcbf29ce484222325ULL;
+        for (sidx_t v : key) h = (h ^ v) * 0x100000001b3ULL;
+        return h;
+    }
+};
 
-wc::wc(we::we& env) {
-    configurations = nullptr;
+wc::wc(we::we& env, uint32_t flags, bool build, size_t strength_in, uint64_t seed_in, size_t threads_in)
+    : threads(threads_in ? threads_in : std::max(1u, std::thread::hardware_concurrency()))
+    , lazy(flags & state_lazy)
+    , accumulate(flags & state_accumulate)
+    , decomposed(flags & state_decompose)
+    , strength(build ? strength_in : 0)
+    , seed(seed_in)
+    , journaled(flags & state_journal) {
     for (we::node* n : env.nodes) {
         n->configure(this);
     }
     // printf("generated %zu options with %zu settings\n", options.size(), settings.size());
-    for (option* opt : options) {
-        std::vector<configuration*>* new_config = new std::vector<configuration*>();
-        if (configurations == nullptr) {
-            configurations = new_config;
-            configuration::begin(configurations, opt);
-        } else {
-            for (configuration* cfg : *configurations) {
-                cfg->branch(new_config, opt);
-            }
-            replace_config(new_config);
+    matrix = compat_matrix(options);
+    if (build) this->build(strength);
+}
+
+wc::wc(we::we& env, const wc& previous, size_t threads_in)
+    : threads(threads_in ? threads_in : std::max(1u, std::thread::hardware_concurrency()))
+    , lazy(previous.lazy)
+    , accumulate(previous.accumulate)
+    , decomposed(previous.decomposed)
+    , seed(previous.seed)
+    , journaled(previous.journaled) {
+    if (previous.strength) {
+        throw std::runtime_error(strprintf("the instance is a covering array of strength %zu, which cannot be updated; compile the specification anew instead", previous.strength));
+    }
+    for (we::node* n : env.nodes) {
+        n->configure(this);
+    }
+    matrix = compat_matrix(options);
+    lineage from(previous, options);
+    for (size_t k = 0; k < options.size(); ++k) {
+        for (size_t i = 0; i < options[k]->settings.size(); ++i) {
+            if (from.settings[k][i] == free_cell) continue;
+            setting* s = options[k]->settings[i];
+            const setting* p = previous.options[from.options[k]]->settings[from.settings[k][i]];
+            s->inclusions = p->inclusions;
+            s->penalty = p->penalty;
+            s->last_penalty = p->last_penalty;
         }
     }
-    // calculate occurrences
-    for (auto& c : *configurations) {
-        for (size_t i = 0; i < c->options.size(); ++i) ++c->si(i)->occurrences;
+    // only lazy and decompose mode instances keep emitted configurations by
+    // id; tables leave them out instead, which expand() works out
+    std::vector<sidx_t> old_row(previous.options.size()), row(options.size());
+    for (cid_t id : previous.emitted) {
+        previous.decode(id, old_row.data());
+        if (from.from_previous(old_row.data(), row.data()) && matrix.accepts(row.data())) emitted.insert(id_of(row.data()));
     }
-    // printf("generated %zu configurations\n", configurations->size());
-    total_combinations = configurations->size();
+    build(0, &from);
+}
+
+void wc::build(size_t strength, const lineage* from) {
+    if (lazy) {
+        survey();
+        return;
+    }
+    if (decomposed) {
+        decompose(from);
+        return;
+    }
+    if (strength) {
+        cover(strength);
+    } else {
+        expand(from);
+    }
+    // printf("generated %zu configurations\n", configurations.size());
+    if (!from) total_combinations = configurations.size();
     normalize();
     blur();
-    sort();
+    if (from && !accumulate) {
+        // the penalties carried over are what penalize() would have taken
+        // off the rows for the emissions so far
+        parallel_rows(configurations.size(), threads, [&](size_t, size_t lo, size_t hi) {
+            for (size_t r = lo; r < hi; ++r) {
+                configurations.pri[r] -= accumulated_penalty(configurations.row(r));
+                configurations.last_penalty[r] = accumulated_last_penalty(configurations.row(r));
+            }
+        });
+    }
+    if (accumulate) {
+        configurations.sort();
+    } else {
+        configurations.heapify();
+    }
 }
 
-wc::wc(FILE* fp) {
-    configurations = new std::vector<configuration*>();
-    load(fp);
-    // size_t idx = configurations->size();
-    // for (auto& c : *configurations) { idx--; c->old_idx = idx; }
-    // for (auto& c : *configurations) { printf("- %s\n", c->to_string().c_str()); }
+wc::wc(FILE* fp, bool in_place) {
+    if (!in_place || !map(fp)) load(fp);
 }
 
-void wc::save(FILE* fp) const {
+wc::~wc() {
+    if (mapped) munmap(mapped, mapped_size);
+}
+
+void wc::expand(const lineage* from) {
+    configurations = table(options.size());
+    if (options.empty()) return;
+    for (const option* o : options) {
+        if (o->settings.size() > std::numeric_limits<sidx_t>::max()) {
+            throw std::runtime_error(strprintf("option %s has too many settings (%zu)", o->name, o->settings.size()));
+        }
+    }
+    if (!from) {
+        enumerate(configurations);
+        tally();
+        return;
+    }
+    // the acceptable configurations made of kept settings alone are the same
+    // as they were for previous, so those it has not emitted yet are the
+    // rows of its table which have only kept settings; the rest, which have
+    // at least one setting which is new or was changed, are enumerated one
+    // option at a time, from those whose first such setting is in the first
+    // option to those where it is in the last
+    const wc& previous = from->previous;
+    size_t n = options.size();
+    std::unordered_set<std::vector<sidx_t>, sidx_key_hash> rest;
+    std::vector<sidx_t> row(n);
+    for (size_t r = 0; r < previous.configurations.size(); ++r) {
+        if (previous.configurations.pri[r] == -INFINITY || !from->from_previous(previous.configurations.row(r), row.data())) continue;
+        bool reused = from->aligned;
+        for (size_t k = 0; reused && k < n; ++k) reused = from->kept[k][row[k]];
+        if (reused) {
+            configurations.push_back(row.data());
+        } else {
+            rest.insert(row);
+        }
+    }
+    table fresh(n);
+    if (!from->aligned) {
+        enumerate(fresh);
+    } else {
+        std::vector<uint64_t> alive = matrix.alive;
+        for (size_t k = 0; k < n; ++k) {
+            if (std::find(from->kept[k].begin(), from->kept[k].end(), false) == from->kept[k].end()) continue;
+            matrix.alive = alive;
+            for (size_t j = 0; j <= k; ++j) {
+                for (size_t i = 0; i < options[j]->settings.size(); ++i) {
+                    size_t g = matrix.base[j] + i;
+                    if ((j < k) != from->kept[j][i]) matrix.alive[g >> 6] &= ~(1ULL << (g & 63));
+                }
+            }
+            enumerate(fresh);
+        }
+        // all of these and the kept configurations, emitted or not, make up
+        // the total; counting the latter needs no walk unless the options
+        // are too interdependent
+        matrix.alive = alive;
+        for (size_t k = 0; k < n; ++k) {
+            for (size_t i = 0; i < options[k]->settings.size(); ++i) {
+                size_t g = matrix.base[k] + i;
+                if (!from->kept[k][i]) matrix.alive[g >> 6] &= ~(1ULL << (g & 63));
+            }
+        }
+        try {
+            count().total.fits(total_combinations);
+        } catch (const std::runtime_error&) {
+            total_combinations = 0;
+            walk([&](const sidx_t*) { ++total_combinations; });
+        }
+        matrix.alive = alive;
+    }
+    total_combinations += fresh.size();
+    // and what we enumerated anew is left out where previous had it, but
+    // not in its table any more, i.e. where it was emitted
+    compat_matrix was(from->one_to_one ? previous.options : std::vector<option*>());
+    std::vector<sidx_t> old_row(previous.options.size());
+    for (size_t r = 0; r < fresh.size(); ++r) {
+        const sidx_t* f = fresh.row(r);
+        if (from->to_previous(f, old_row.data()) && was.accepts(old_row.data()) && !rest.count(std::vector<sidx_t>(f, f + n))) continue;
+        configurations.push_back(f);
+    }
+    tally();
+    // the emitted configurations are no longer in the table, but still
+    // count towards how often their settings occur
+    for (option* o : options) {
+        for (setting* s : o->settings) s->occurrences += s->inclusions;
+    }
+}
+
+void wc::enumerate(table& t) const {
+    size_t n = options.size();
+    if (n == 0) return;
+    // the subtrees below each acceptable combination of the first few
+    // options are walked in parallel, each into a table of its own; putting
+    // these together in order gives the same table as a single walk would
+    size_t depth = 0, chunks = 1;
+    while (depth < n && chunks < 16 * threads) chunks *= options[depth++]->settings.size();
+    std::vector<size_t> head(depth), all(n);
+    for (size_t k = 0; k < n; ++k) all[k] = k;
+    std::copy(all.begin(), all.begin() + depth, head.begin());
+    std::vector<sidx_t> prefixes;
+    walk(head, [&](const sidx_t* prefix) { prefixes.insert(prefixes.end(), prefix, prefix + depth); });
+    std::vector<table> results(prefixes.size() / depth, table(n));
+    parallel_for(results.size(), threads, [&](size_t c) {
+        walk(all, [&](const sidx_t* row) { results[c].push_back(row); }, &prefixes[c * depth], depth);
+    });
+    std::vector<size_t> offset{t.size()};
+    for (const table& r : results) offset.push_back(offset.back() + r.size());
+    t.reserve(offset.back());
+    t.rows = offset.back();
+    parallel_for(results.size(), threads, [&](size_t c) {
+        table& r = results[c];
+        std::fill_n(t.pri + offset[c], r.size(), 0.f);
+        std::fill_n(t.last_penalty + offset[c], r.size(), 0.f);
+        std::copy(r.cells, r.cells + r.size() * n, t.row(offset[c]));
+        r = table(n);
+    });
+}
+
+void wc::tally() {
+    // calculate occurrences, one slice of the table per thread
+    size_t n = options.size();
+    std::vector<size_t> base{0};
+    for (const option* o : options) base.push_back(base.back() + o->settings.size());
+    std::vector<std::vector<size_t>> counts(threads, std::vector<size_t>(base.back(), 0));
+    parallel_rows(configurations.size(), threads, [&](size_t c, size_t lo, size_t hi) {
+        std::vector<size_t>& count = counts[c];
+        for (size_t r = lo; r < hi; ++r) {
+            const sidx_t* row = configurations.row(r);
+            for (size_t i = 0; i < n; ++i) ++count[base[i] + row[i]];
+        }
+    });
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < options[i]->settings.size(); ++j) {
+            for (const auto& count : counts) options[i]->settings[j]->occurrences += count[base[i] + j];
+        }
+    }
+    // drop build-time scaffolding; the options reference their own settings
+    std::vector<setting*>().swap(settings);
+    option_map.clear();
+    matrix = compat_matrix();
+}
+
+bool wc::complete(sidx_t* row) const {
+    size_t words = matrix.words;
+    std::vector<size_t> open;
+    std::vector<uint64_t> allowed(matrix.alive);
+    for (size_t k = 0; k < options.size(); ++k) {
+        if (row[k] == free_cell) {
+            open.push_back(k);
+            continue;
+        }
+        size_t g = matrix.base[k] + row[k];
+        if (!compat_matrix::test(allowed.data(), g)) return false;
+        matrix.narrow(allowed.data(), allowed.data(), g);
+    }
+    // depth first as in walk(), stopping at the first acceptable completion
+    size_t f = open.size();
+    if (f == 0) return true;
+    allowed.resize((f + 1) * words);
+    std::vector<size_t> next(f, 0);
+    size_t j = 0;
+    for (;;) {
+        if (next[j] == options[open[j]]->settings.size()) {
+            if (j == 0) return false;
+            --j;
+            continue;
+        }
+        size_t i = next[j]++;
+        size_t g = matrix.base[open[j]] + i;
+        if (!compat_matrix::test(&allowed[j * words], g)) continue;
+        row[open[j]] = i;
+        if (j + 1 == f) return true;
+        matrix.narrow(&allowed[(j + 1) * words], &allowed[j * words], g);
+        next[++j] = 0;
+    }
+}
+
+void wc::cover(size_t strength) {
+    size_t n = options.size();
+    configurations = table(n);
+    if (n == 0) return;
+    for (const option* o : options) {
+        if (o->settings.size() >= free_cell) {
+            throw std::runtime_error(strprintf("option %s has too many settings (%zu)", o->name, o->settings.size()));
+        }
+    }
+    if (strength == 0) throw std::runtime_error("covering strength must be at least 1");
+    if (strength > n) strength = n;
+    std::vector<sidx_t> scratch(n);
+    auto fits = [&](const std::vector<sidx_t>& row) {
+        std::copy(row.begin(), row.end(), scratch.begin());
+        return complete(scratch.data());
+    };
+
+    // options with the most settings go first, as that keeps the array small
+    std::vector<size_t> ord(n);
+    for (size_t k = 0; k < n; ++k) ord[k] = k;
+    std::stable_sort(ord.begin(), ord.end(), [&](size_t a, size_t b) { return options[a]->settings.size() > options[b]->settings.size(); });
+
+    // rows are partial configurations, with free_cell wherever any setting
+    // will do, and are kept completable throughout; they start out as every
+    // combination of the first strength options
+    std::vector<std::vector<sidx_t>> rows;
+    std::vector<size_t> first(ord.begin(), ord.begin() + strength);
+    walk(first, [&](const sidx_t* combo) {
+        std::vector<sidx_t> row(n, free_cell);
+        for (size_t j = 0; j < strength; ++j) row[first[j]] = combo[j];
+        if (fits(row)) rows.push_back(row);
+    });
+
+    // each further option k brings the tuples combining one of its settings
+    // with strength - 1 settings of the options before it; rows are extended
+    // to cover as many of them as they can (horizontal growth), and rows are
+    // added or filled in for the rest (vertical growth)
+    for (size_t p = strength; p < n; ++p) {
+        size_t k = ord[p];
+        size_t m = options[k]->settings.size();
+        std::vector<std::vector<size_t>> groups;
+        std::vector<size_t> pick(strength - 1);
+        for (size_t j = 0; j < pick.size(); ++j) pick[j] = j;
+        for (;;) {
+            std::vector<size_t> group;
+            for (size_t j : pick) group.push_back(ord[j]);
+            groups.push_back(group);
+            // next combination of strength - 1 of the positions 0..p-1
+            size_t j = pick.size();
+            while (j > 0 && pick[j - 1] == p - pick.size() + j - 1) --j;
+            if (j == 0) break;
+            ++pick[j - 1];
+            for (size_t l = j; l < pick.size(); ++l) pick[l] = pick[l - 1] + 1;
+        }
+        // tuples of each group are numbered as mixed-radix numbers over the
+        // group's options, followed by k
+        std::vector<size_t> offset{0};
+        for (const auto& group : groups) {
+            size_t size = m;
+            for (size_t o : group) size *= options[o]->settings.size();
+            offset.push_back(offset.back() + size);
+        }
+        auto tuple_base = [&](size_t gi, const std::vector<sidx_t>& row) {
+            size_t idx = 0;
+            for (size_t o : groups[gi]) {
+                if (row[o] == free_cell) return SIZE_MAX;
+                idx = idx * options[o]->settings.size() + row[o];
+            }
+            return offset[gi] + idx * m;
+        };
+        // only tuples which some configuration contains need covering; the
+        // requirements between their own settings are checked here, and the
+        // rest once a tuple turns out to need a row of its own
+        std::vector<char> missing(offset.back(), 0);
+        size_t left = 0;
+        std::vector<size_t> g(strength);
+        for (size_t gi = 0; gi < groups.size(); ++gi) {
+            for (size_t idx = 0; idx < offset[gi + 1] - offset[gi]; ++idx) {
+                size_t rest = idx;
+                g[strength - 1] = matrix.base[k] + rest % m;
+                rest /= m;
+                for (size_t j = groups[gi].size(); j > 0; --j) {
+                    size_t o = groups[gi][j - 1];
+                    g[j - 1] = matrix.base[o] + rest % options[o]->settings.size();
+                    rest /= options[o]->settings.size();
+                }
+                bool ok = true;
+                for (size_t a = 0; ok && a < strength; ++a) {
+                    ok = compat_matrix::test(matrix.alive.data(), g[a]);
+                    for (size_t b = 0; ok && b < a; ++b) ok = compat_matrix::test(matrix.mask(g[a]), g[b]);
+                }
+                if (ok) {
+                    missing[offset[gi] + idx] = 1;
+                    ++left;
+                }
+            }
+        }
+        auto mark = [&](const std::vector<sidx_t>& row) {
+            if (row[k] == free_cell) return;
+            for (size_t gi = 0; gi < groups.size(); ++gi) {
+                size_t b = tuple_base(gi, row);
+                if (b != SIZE_MAX && missing[b + row[k]]) {
+                    missing[b + row[k]] = 0;
+                    --left;
+                }
+            }
+        };
+
+        // horizontal growth: give each row the setting of k which covers the
+        // most missing tuples, leaving it free if none covers any
+        std::vector<size_t> gain(m);
+        for (auto& row : rows) {
+            if (left == 0) break;
+            std::fill(gain.begin(), gain.end(), 0);
+            for (size_t gi = 0; gi < groups.size(); ++gi) {
+                size_t b = tuple_base(gi, row);
+                if (b == SIZE_MAX) continue;
+                for (size_t v = 0; v < m; ++v) gain[v] += missing[b + v];
+            }
+            for (;;) {
+                size_t best = std::max_element(gain.begin(), gain.end()) - gain.begin();
+                if (gain[best] == 0) break;
+                row[k] = best;
+                if (fits(row)) break;
+                row[k] = free_cell;
+                gain[best] = 0;
+            }
+            mark(row);
+        }
+
+        // vertical growth: fit each tuple still missing into the first row
+        // which has room for it, or into a new one
+        for (size_t gi = 0; gi < groups.size() && left; ++gi) {
+            const std::vector<size_t>& group = groups[gi];
+            std::vector<sidx_t> cells(group.size() + 1);
+            for (size_t idx = 0; idx < offset[gi + 1] - offset[gi]; ++idx) {
+                if (!missing[offset[gi] + idx]) continue;
+                size_t rest = idx;
+                cells[group.size()] = rest % m;
+                rest /= m;
+                for (size_t j = group.size(); j > 0; --j) {
+                    cells[j - 1] = rest % options[group[j - 1]]->settings.size();
+                    rest /= options[group[j - 1]]->settings.size();
+                }
+                auto place = [&](std::vector<sidx_t>& row) {
+                    for (size_t j = 0; j <= group.size(); ++j) {
+                        size_t o = j < group.size() ? group[j] : k;
+                        if (row[o] != free_cell && row[o] != cells[j]) return false;
+                    }
+                    std::copy(row.begin(), row.end(), scratch.begin());
+                    for (size_t j = 0; j <= group.size(); ++j) scratch[j < group.size() ? group[j] : k] = cells[j];
+                    if (!complete(scratch.data())) return false;
+                    for (size_t j = 0; j <= group.size(); ++j) row[j < group.size() ? group[j] : k] = cells[j];
+                    return true;
+                };
+                bool placed = false;
+                for (auto& row : rows) {
+                    if ((placed = place(row))) {
+                        mark(row);
+                        break;
+                    }
+                }
+                if (!placed) {
+                    std::vector<sidx_t> row(n, free_cell);
+                    if (place(row)) {
+                        rows.push_back(row);
+                        mark(row);
+                    } else {
+                        // no acceptable configuration contains it
+                        missing[offset[gi] + idx] = 0;
+                        --left;
+                    }
+                }
+            }
+        }
+    }
+
+    // settle whatever is still free, and drop rows which end up the same
+    std::set<std::vector<sidx_t>> seen;
+    for (auto& row : rows) {
+        complete(row.data());
+        if (seen.insert(row).second) configurations.push_back(row.data());
+    }
+    tally();
+}
+
+void wc::survey() {
+    // the ids must fit, or the space can't be walked as one number
+    cid_t space = 1;
+    for (const option* o : options) {
+        if (o->settings.size() > std::numeric_limits<sidx_t>::max() || space > std::numeric_limits<cid_t>::max() / o->settings.size()) {
+            throw std::runtime_error("combination space too large for lazy enumeration");
+        }
+        space *= o->settings.size();
+    }
+    // counting gives us the total, the priority range and, one setting at a
+    // time, the occurrences, all without visiting a single configuration
+    census c = count();
+    float min = 1e99, max = -1e99;
+    c.total.fits(total_combinations);
+    if (!c.total.zero()) {
+        min = c.min_pri;
+        max = c.max_pri;
+    }
+    for (size_t k = 0; k < options.size(); ++k) {
+        for (size_t i = 0; i < options[k]->settings.size(); ++i) {
+            count(k, i).total.fits(options[k]->settings[i]->occurrences);
+        }
+    }
+    base_min = min;
+    base_len = total_combinations ? max - min : 0;
+    std::vector<setting*>().swap(settings);
+    option_map.clear();
+}
+
+/**
+ * linked[a][b]: whether the requirements rule out some combination of a usable
+ * setting (usable(k, i)) of option a with one of option b.
+ */
+template<typename U> static std::vector<std::vector<bool>> option_links(const std::vector<option*>& options, const compat_matrix& matrix, U usable) {
+    size_t n = options.size();
+    std::vector<std::vector<bool>> linked(n, std::vector<bool>(n, false));
+    for (size_t a = 0; a < n; ++a) {
+        for (size_t b = 0; b < a; ++b) {
+            bool l = false;
+            for (size_t i = 0; !l && i < options[a]->settings.size(); ++i) {
+                if (!usable(a, i)) continue;
+                const uint64_t* m = matrix.mask(matrix.base[a] + i);
+                for (size_t j = 0; !l && j < options[b]->settings.size(); ++j) {
+                    l = usable(b, j) && !compat_matrix::test(m, matrix.base[b] + j);
+                }
+            }
+            linked[a][b] = linked[b][a] = l;
+        }
+    }
+    return linked;
+}
+
+census wc::count(size_t fixed_option, size_t fixed_setting) const {
+    census c;
+    size_t n = options.size();
+    if (n == 0) return c;
+    for (const option* o : options) {
+        if (o->settings.size() > std::numeric_limits<sidx_t>::max()) {
+            throw std::runtime_error(strprintf("option %s has too many settings (%zu)", o->name, o->settings.size()));
+        }
+    }
+    auto usable = [&](size_t k, size_t i) {
+        return compat_matrix::test(matrix.alive.data(), matrix.base[k] + i) && (k != fixed_option || i == fixed_setting);
+    };
+    std::vector<size_t> radix(n, 0);
+    for (size_t a = 0; a < n; ++a) {
+        for (size_t i = 0; i < options[a]->settings.size(); ++i) radix[a] += usable(a, i);
+    }
+    std::vector<std::vector<bool>> linked = option_links(options, matrix, usable);
+    // the count does not depend on the order the options are added in, but
+    // the frontier does; greedily add whichever option leaves the smallest
+    // one (by its number of setting combinations), earliest declared first
+    std::vector<size_t> order;
+    std::vector<bool> added(n, false);
+    std::vector<size_t> open(n, 0); // links to options not yet added
+    for (size_t a = 0; a < n; ++a) {
+        for (size_t b = 0; b < n; ++b) open[a] += linked[a][b];
+    }
+    while (order.size() < n) {
+        size_t best = n;
+        double best_size = 0;
+        for (size_t x = 0; x < n; ++x) {
+            if (added[x]) continue;
+            double size = 0;
+            for (size_t a = 0; a < n; ++a) {
+                if (!(added[a] || a == x)) continue;
+                size_t left = open[a] - (a != x && linked[a][x]);
+                if (left) size += std::log(std::max<size_t>(radix[a], 1));
+            }
+            if (best == n || size < best_size) {
+                best = x;
+                best_size = size;
+            }
+        }
+        added[best] = true;
+        order.push_back(best);
+        for (size_t a = 0; a < n; ++a) if (linked[a][best]) --open[a];
+    }
+    for (size_t a = 0; a < n; ++a) {
+        open[a] = 0;
+        for (size_t b = 0; b < n; ++b) open[a] += linked[a][b];
+    }
+    struct cell {
+        bigcount n;
+        int lo, hi;
+    };
+    typedef std::unordered_map<std::vector<sidx_t>, cell, sidx_key_hash> state_map;
+    const size_t limit = 1 << 20;
+    // states: settings picked for the frontier options -> count
+    std::vector<size_t> frontier;
+    state_map states;
+    states[std::vector<sidx_t>()] = cell{bigcount(1), 0, 0};
+    for (size_t k : order) {
+        for (size_t a = 0; a < n; ++a) if (linked[a][k]) --open[a];
+        std::vector<size_t> next_frontier;
+        std::vector<size_t> keep; // positions in old keys carried over
+        for (size_t f = 0; f < frontier.size(); ++f) {
+            if (open[frontier[f]]) {
+                next_frontier.push_back(frontier[f]);
+                keep.push_back(f);
+            }
+        }
+        bool stays = open[k] > 0;
+        if (stays) next_frontier.push_back(k);
+        state_map next;
+        std::vector<sidx_t> key(next_frontier.size());
+        for (const auto& st : states) {
+            for (size_t i = 0; i < options[k]->settings.size(); ++i) {
+                size_t g = matrix.base[k] + i;
+                if (!usable(k, i)) continue;
+                bool ok = true;
+                for (size_t f = 0; ok && f < frontier.size(); ++f) {
+                    ok = !linked[frontier[f]][k] || compat_matrix::test(matrix.mask(matrix.base[frontier[f]] + st.first[f]), g);
+                }
+                if (!ok) continue;
+                for (size_t f = 0; f < keep.size(); ++f) key[f] = st.first[keep[f]];
+                if (stays) key.back() = i;
+                int pri = options[k]->settings[i]->priority;
+                auto it = next.find(key);
+                if (it == next.end()) {
+                    if (next.size() == limit) throw std::runtime_error(strprintf("options are too interdependent to count (more than %zu combinations of %zu options to track)", limit, next_frontier.size()));
+                    next.emplace(key, cell{st.second.n, st.second.lo + pri, st.second.hi + pri});
+                } else {
+                    it->second.n += st.second.n;
+                    it->second.lo = std::min(it->second.lo, st.second.lo + pri);
+                    it->second.hi = std::max(it->second.hi, st.second.hi + pri);
+                }
+            }
+        }
+        states.swap(next);
+        frontier.swap(next_frontier);
+    }
+    // the frontier is empty by now, so there is at most one state left
+    for (const auto& st : states) {
+        c.total = st.second.n;
+        c.min_pri = st.second.lo;
+        c.max_pri = st.second.hi;
+    }
+    return c;
+}
+
+void wc::decompose(const lineage* from) {
+    // the ids must fit, as in lazy mode
+    cid_t space = 1;
+    for (const option* o : options) {
+        if (o->settings.size() > std::numeric_limits<sidx_t>::max() || space > std::numeric_limits<cid_t>::max() / o->settings.size()) {
+            throw std::runtime_error("combination space too large to decompose");
+        }
+        space *= o->settings.size();
+    }
+    // parts are the connected components of the options, linked where the
+    // requirements rule out some combination of their settings
+    size_t n = options.size();
+    std::vector<std::vector<bool>> linked = option_links(options, matrix, [&](size_t k, size_t i) {
+        return compat_matrix::test(matrix.alive.data(), matrix.base[k] + i);
+    });
+    std::vector<size_t> component(n, n);
+    parts.clear();
+    for (size_t a = 0; a < n; ++a) {
+        if (component[a] != n) continue;
+        part p;
+        std::vector<size_t> todo{a};
+        component[a] = parts.size();
+        while (!todo.empty()) {
+            size_t x = todo.back();
+            todo.pop_back();
+            p.options.push_back(x);
+            for (size_t y = 0; y < n; ++y) {
+                if (linked[x][y] && component[y] == n) {
+                    component[y] = parts.size();
+                    todo.push_back(y);
+                }
+            }
+        }
+        std::sort(p.options.begin(), p.options.end());
+        p.rows = table(p.options.size());
+        if (const part* old = from ? from->unchanged(p.options) : nullptr) {
+            // nothing about these options changed, so neither did the
+            // acceptable combinations of their settings
+            std::vector<sidx_t> row(p.options.size());
+            for (size_t r = 0; r < old->rows.size(); ++r) {
+                for (size_t j = 0; j < row.size(); ++j) row[j] = from->images[p.options[j]][old->rows.row(r)[j]];
+                p.rows.push_back(row.data());
+            }
+        } else {
+            walk(p.options, [&](const sidx_t* row) { p.rows.push_back(row); });
+        }
+        parts.push_back(std::move(p));
+    }
+    // a configuration's priority is the sum of its parts', so normalizing
+    // over all configurations is normalizing each part by its own minimum and
+    // the total range; occurrences multiply by the size of the other parts
+    std::vector<int> lo(parts.size(), 0), hi(parts.size(), 0);
+    total_combinations = n ? 1 : 0;
+    for (size_t p = 0; p < parts.size(); ++p) {
+        const part& pt = parts[p];
+        for (size_t r = 0; r < pt.rows.size(); ++r) {
+            int pri = 0;
+            for (size_t j = 0; j < pt.options.size(); ++j) pri += options[pt.options[j]]->settings[pt.rows.row(r)[j]]->priority;
+            pt.rows.pri[r] = pri;
+            if (r == 0 || pri < lo[p]) lo[p] = pri;
+            if (r == 0 || pri > hi[p]) hi[p] = pri;
+        }
+        total_combinations *= pt.rows.size();
+    }
+    base_min = base_len = 0;
+    for (size_t p = 0; p < parts.size(); ++p) {
+        base_min += lo[p];
+        base_len += hi[p] - lo[p];
+    }
+    for (size_t p = 0; p < parts.size(); ++p) {
+        part& pt = parts[p];
+        size_t others = pt.rows.size() ? total_combinations / pt.rows.size() : 0;
+        for (size_t r = 0; r < pt.rows.size(); ++r) {
+            for (size_t j = 0; j < pt.options.size(); ++j) options[pt.options[j]]->settings[pt.rows.row(r)[j]]->occurrences += others;
+            // the blur is spread over the parts, so it adds up to what
+            // blur() would have added to the whole configuration; each part
+            // draws from a stream of its own
+            pt.rows.pri[r] = (base_len == 0 ? 0 : (pt.rows.pri[r] - lo[p]) / base_len) + (hrand(seed + mix64(p + 1), r) - 0.5) / 10 / parts.size();
+        }
+    }
+    std::vector<setting*>().swap(settings);
+    option_map.clear();
+    matrix = compat_matrix();
+}
+
+lineage::lineage(const wc& previous_in, const std::vector<option*>& next) : previous(previous_in) {
+    std::map<std::string,size_t> index;
+    for (size_t k = 0; k < previous.options.size(); ++k) index[previous.options[k]->name] = k;
+    size_t n = next.size(), matched = 0;
+    options.assign(n, SIZE_MAX);
+    settings.resize(n);
+    images.resize(n);
+    kept.resize(n);
+    aligned = true;
+    for (size_t k = 0; k < n; ++k) {
+        const option* o = next[k];
+        settings[k].assign(o->settings.size(), free_cell);
+        kept[k].assign(o->settings.size(), false);
+        auto it = index.find(o->name);
+        if (it == index.end()) continue;
+        const option* p = previous.options[it->second];
+        options[k] = it->second;
+        aligned &= it->second == k;
+        ++matched;
+        // settings with the same value are paired up in order
+        std::map<std::string,std::vector<size_t>> by_value;
+        for (size_t j = p->settings.size(); j > 0; --j) by_value[p->settings[j - 1]->value].push_back(j - 1);
+        images[k].assign(p->settings.size(), free_cell);
+        for (size_t i = 0; i < o->settings.size(); ++i) {
+            auto v = by_value.find(o->settings[i]->value);
+            if (v == by_value.end() || v->second.empty()) continue;
+            size_t j = v->second.back();
+            v->second.pop_back();
+            settings[k][i] = j;
+            images[k][j] = i;
+            const std::vector<req*>& a = o->settings[i]->requirements;
+            const std::vector<req*>& b = p->settings[j]->requirements;
+            kept[k][i] = a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const req* x, const req* y) {
+                return x->var == y->var && x->val == y->val && x->cond == y->cond;
+            });
+        }
+    }
+    one_to_one = matched == n && n == previous.options.size();
+    aligned &= one_to_one;
+}
+
+bool lineage::from_previous(const sidx_t* row, sidx_t* out) const {
+    if (!one_to_one) return false;
+    for (size_t k = 0; k < options.size(); ++k) {
+        out[k] = images[k][row[options[k]]];
+        if (out[k] == free_cell) return false;
+    }
+    return true;
+}
+
+bool lineage::to_previous(const sidx_t* row, sidx_t* out) const {
+    if (!one_to_one) return false;
+    for (size_t k = 0; k < options.size(); ++k) {
+        out[options[k]] = settings[k][row[k]];
+        if (out[options[k]] == free_cell) return false;
+    }
+    return true;
+}
+
+const part* lineage::unchanged(const std::vector<size_t>& opts) const {
+    if (!aligned) return nullptr;
+    for (size_t k : opts) {
+        if (images[k].size() != kept[k].size() || std::find(kept[k].begin(), kept[k].end(), false) != kept[k].end()) return nullptr;
+    }
+    for (const part& pt : previous.parts) {
+        if (pt.options == opts) return &pt;
+    }
+    return nullptr;
+}
+
+size_t wc::remaining_rows() const {
+    if (!accumulate) return configurations.size();
+    return std::count_if(configurations.pri, configurations.pri + configurations.size(), [](float pri) { return pri != -INFINITY; });
+}
+
+size_t wc::remaining() const {
+    return lazy || decomposed ? total_combinations - emitted.size() : remaining_rows();
+}
+
+cid_t wc::id_of(const sidx_t* row) const {
+    cid_t id = 0;
+    for (size_t i = 0; i < options.size(); ++i) id = id * options[i]->settings.size() + row[i];
+    return id;
+}
+
+void wc::decode(cid_t id, sidx_t* row) const {
+    for (size_t i = options.size(); i > 0; --i) {
+        size_t radix = options[i - 1]->settings.size();
+        row[i - 1] = id % radix;
+        id /= radix;
+    }
+}
+
+float wc::accumulated_penalty(const sidx_t* row) const {
+    float penalty = 0;
+    for (size_t i = 0; i < options.size(); ++i) penalty += si(row, i)->penalty;
+    return penalty;
+}
+
+float wc::accumulated_last_penalty(const sidx_t* row) const {
+    float last_penalty = 0;
+    for (size_t i = 0; i < options.size(); ++i) last_penalty += si(row, i)->last_penalty;
+    return last_penalty;
+}
+
+float wc::penalty_floor() const {
+    // the least penalty any configuration can carry
+    float floor = 0;
+    for (size_t i = 0; i < options.size(); ++i) {
+        float least = options[i]->settings[0]->penalty;
+        for (const setting* s : options[i]->settings) least = std::min(least, s->penalty);
+        floor += least;
+    }
+    return floor;
+}
+
+float wc::lazy_pri(const sidx_t* row) const {
+    // same as normalize() + blur() followed by the penalize() calls for every
+    // emission so far, but derived from the settings instead of stored
+    float pri = base_len == 0 ? 0 : (calc_pri(row) + -base_min) / base_len;
+    pri += (hrand(seed, id_of(row)) - 0.5) / 10;
+    return pri - accumulated_penalty(row);
+}
+
+bool wc::find_lazy(sidx_t* best) const {
+    // depth first like walk(), but a prefix is only descended into if the
+    // best priority any configuration under it could have beats what we have
+    size_t n = options.size();
+    if (n == 0) return false;
+    // pri_ceiling[k]/least_penalty[k]: the most priority and least penalty
+    // that options k.. can add to a configuration
+    std::vector<float> pri_ceiling(n + 1, 0), least_penalty(n + 1, 0);
+    for (size_t k = n; k > 0; --k) {
+        const std::vector<setting*>& settings = options[k - 1]->settings;
+        int most = settings[0]->priority;
+        float least = settings[0]->penalty;
+        for (const setting* s : settings) {
+            most = std::max(most, s->priority);
+            least = std::min(least, s->penalty);
+        }
+        pri_ceiling[k - 1] = pri_ceiling[k] + most;
+        least_penalty[k - 1] = least_penalty[k] + least;
+    }
+    size_t words = matrix.words;
+    std::vector<uint64_t> allowed((n + 1) * words);
+    std::copy(matrix.alive.begin(), matrix.alive.end(), allowed.begin());
+    std::vector<sidx_t> row(n);
+    std::vector<size_t> next(n, 0);
+    std::vector<float> pri_sum(n + 1, 0), penalty_sum(n + 1, 0);
+    float best_pri = 0;
+    bool found = false;
+    size_t k = 0;
+    for (;;) {
+        if (next[k] == options[k]->settings.size()) {
+            if (k == 0) break;
+            --k;
+            continue;
+        }
+        size_t i = next[k]++;
+        size_t g = matrix.base[k] + i;
+        if (!compat_matrix::test(&allowed[k * words], g)) continue;
+        const setting* s = options[k]->settings[i];
+        pri_sum[k + 1] = pri_sum[k] + s->priority;
+        penalty_sum[k + 1] = penalty_sum[k] + s->penalty;
+        if (found) {
+            float ceiling = pri_sum[k + 1] + pri_ceiling[k + 1];
+            float bound = (base_len == 0 ? 0 : (ceiling + -base_min) / base_len) + 0.05 - (penalty_sum[k + 1] + least_penalty[k + 1]);
+            if (bound < best_pri) continue;
+        }
+        row[k] = i;
+        if (k + 1 < n) {
+            matrix.narrow(&allowed[(k + 1) * words], &allowed[k * words], g);
+            next[++k] = 0;
+            continue;
+        }
+        if (emitted.count(id_of(row.data()))) continue;
+        float pri = lazy_pri(row.data());
+        if (!found || pri > best_pri) {
+            found = true;
+            best_pri = pri;
+            memcpy(best, row.data(), n * sizeof(sidx_t));
+        }
+    }
+    return found;
+}
+
+bool wc::find_accumulated(size_t& best) const {
+    // rows are in ascending order of base priority and penalties only ever
+    // lower it, so we can stop as soon as a row's base, less the least
+    // penalty anything could carry, falls short of the best row so far
+    const float* pri = configurations.pri;
+    float floor = penalty_floor();
+    float best_pri = 0;
+    bool found = false;
+    for (size_t r = configurations.size(); r > 0; --r) {
+        if (pri[r - 1] == -INFINITY) continue; // emitted
+        if (found && pri[r - 1] - floor <= best_pri) break;
+        float p = pri[r - 1] - accumulated_penalty(configurations.row(r - 1));
+        if (!found || p > best_pri) {
+            found = true;
+            best_pri = p;
+            best = r - 1;
+        }
+    }
+    return found;
+}
+
+bool wc::find_composite(sidx_t* best) const {
+    // a configuration's priority is the sum of its rows' in each part, so
+    // with every part ranked best first, the best one is made of the first
+    // row of each; if that has been emitted, combinations are visited best
+    // first (each combination is reached from exactly one parent, which has
+    // an index one lower in the last part where the two differ, so the
+    // search never revisits any) until one has not
+    size_t np = parts.size();
+    if (np == 0) return false;
+    std::vector<std::vector<std::pair<float, size_t>>> ranked(np);
+    for (size_t p = 0; p < np; ++p) {
+        const part& pt = parts[p];
+        if (pt.rows.size() == 0) return false;
+        for (size_t r = 0; r < pt.rows.size(); ++r) {
+            float pri = pt.rows.pri[r];
+            for (size_t j = 0; j < pt.options.size(); ++j) pri -= options[pt.options[j]]->settings[pt.rows.row(r)[j]]->penalty;
+            ranked[p].push_back(std::make_pair(pri, r));
+        }
+        std::stable_sort(ranked[p].begin(), ranked[p].end(), [](const std::pair<float, size_t>& a, const std::pair<float, size_t>& b) { return a.first > b.first; });
+    }
+    struct node {
+        float pri;
+        size_t last;
+        std::vector<size_t> idx;
+        bool operator<(const node& other) const { return pri < other.pri; }
+    };
+    std::priority_queue<node> queue;
+    node top{0, 0, std::vector<size_t>(np, 0)};
+    for (size_t p = 0; p < np; ++p) top.pri += ranked[p][0].first;
+    queue.push(top);
+    std::vector<sidx_t> row(options.size());
+    while (!queue.empty()) {
+        node nd = queue.top();
+        queue.pop();
+        for (size_t p = 0; p < np; ++p) {
+            const part& pt = parts[p];
+            const sidx_t* pr = pt.rows.row(ranked[p][nd.idx[p]].second);
+            for (size_t j = 0; j < pt.options.size(); ++j) row[pt.options[j]] = pr[j];
+        }
+        if (!emitted.count(id_of(row.data()))) {
+            memcpy(best, row.data(), row.size() * sizeof(sidx_t));
+            return true;
+        }
+        for (size_t p = nd.last; p < np; ++p) {
+            if (nd.idx[p] + 1 == ranked[p].size()) continue;
+            node child = nd;
+            child.last = p;
+            child.pri += ranked[p][nd.idx[p] + 1].first - ranked[p][nd.idx[p]].first;
+            ++child.idx[p];
+            queue.push(child);
+        }
+    }
+    return false;
+}
+
+table wc::snapshot(size_t top) const {
+    table t(options.size());
+    if (!lazy && !decomposed && !accumulate) {
+        if (top >= configurations.size()) {
+            t = configurations;
+        } else {
+            // the table is a heap, so the best rows are found by walking it
+            // best first, which never looks below the top rows' children
+            std::priority_queue<std::pair<float, size_t>> frontier;
+            if (top) frontier.push(std::make_pair(configurations.pri[0], (size_t)0));
+            while (t.size() < top) {
+                size_t r = frontier.top().second;
+                frontier.pop();
+                t.push_back(configurations.row(r), configurations.pri[r], configurations.last_penalty[r]);
+                for (size_t c = 2 * r + 1; c <= 2 * r + 2 && c < configurations.size(); ++c) frontier.push(std::make_pair(configurations.pri[c], c));
+            }
+        }
+        t.sort();
+        return t;
+    }
+    // anything which cannot make the top is dropped as we go, so at most
+    // twice as many rows as asked for are ever kept
+    auto add = [&](const sidx_t* row, float pri, float last_penalty) {
+        t.push_back(row, pri, last_penalty);
+        if (t.size() >= top && t.size() - top >= std::max<size_t>(top, 1)) t.keep_top(top);
+    };
+    if (lazy) {
+        walk([&](const sidx_t* row) {
+            if (!emitted.count(id_of(row))) add(row, lazy_pri(row), accumulated_last_penalty(row));
+        });
+    } else if (decomposed) {
+        // every combination of part rows, so this is as large as the
+        // instance would have been without decomposing it
+        size_t np = parts.size();
+        std::vector<size_t> idx(np, 0);
+        std::vector<sidx_t> row(options.size());
+        for (size_t p = 0; p < np; ++p) if (parts[p].rows.size() == 0) np = 0;
+        while (np) {
+            float pri = 0;
+            for (size_t p = 0; p < np; ++p) {
+                const part& pt = parts[p];
+                const sidx_t* pr = pt.rows.row(idx[p]);
+                for (size_t j = 0; j < pt.options.size(); ++j) row[pt.options[j]] = pr[j];
+                pri += pt.rows.pri[idx[p]];
+            }
+            if (!emitted.count(id_of(row.data()))) add(row.data(), pri - accumulated_penalty(row.data()), accumulated_last_penalty(row.data()));
+            size_t p = np;
+            while (p > 0 && ++idx[p - 1] == parts[p - 1].rows.size()) idx[--p] = 0;
+            if (p == 0) break;
+        }
+    } else {
+        for (size_t r = 0; r < configurations.size(); ++r) {
+            const sidx_t* row = configurations.row(r);
+            if (configurations.pri[r] != -INFINITY) add(row, configurations.pri[r] - accumulated_penalty(row), accumulated_last_penalty(row));
+        }
+    }
+    t.keep_top(top);
+    t.sort();
+    return t;
+}
+
+void wc::save_schema(FILE* fp) const {
     serialize(fp, total_combinations);
     serialize(fp, emits);
     vpser(fp, options);
-    vpser(fp, *configurations);
-    // size_t idx = configurations->size();
-    // for (auto& c : *configurations) { idx--; printf("- %zu->%zu %s\n", c->old_idx, idx, c->to_string().c_str()); }
 }
 
-void wc::load(FILE* fp) {
+void wc::load_schema(FILE* fp) {
     deserialize(fp, total_combinations);
     emits = deserialize_string(fp);
-    vpdes(fp, options, option);
+    vpdes(fp, options, option, pool);
+}
+
+void wc::save_state(FILE* fp) const {
+    serialize(fp, state_magic);
+    serialize(fp, (lazy ? (uint32_t)state_lazy : 0) | (accumulate ? (uint32_t)state_accumulate : 0) | (journaled ? (uint32_t)state_journal : 0) | (decomposed ? (uint32_t)state_decompose : 0) | (strength ? (uint32_t)state_covering : 0));
+    serialize(fp, seed);
+    serialize(fp, base_min);
+    serialize(fp, base_len);
+    for (const option* o : options) {
+        for (const setting* s : o->settings) {
+            serialize(fp, s->penalty);
+            serialize(fp, s->last_penalty);
+        }
+    }
+    serialize(fp, emitted.size());
+    for (cid_t id : emitted) serialize(fp, id);
+    if (decomposed) serialize(fp, parts);
+    if (strength) serialize(fp, strength);
+}
+
+bool wc::load_state(FILE* fp) {
+    uint32_t magic, flags;
+    if (fread(&magic, sizeof(magic), 1, fp) != 1 || magic != state_magic) return false;
+    deserialize(fp, flags);
+    lazy = flags & state_lazy;
+    accumulate = flags & state_accumulate;
+    journaled = flags & state_journal;
+    decomposed = flags & state_decompose;
+    deserialize(fp, seed);
+    deserialize(fp, base_min);
+    deserialize(fp, base_len);
+    for (option* o : options) {
+        for (setting* s : o->settings) {
+            deserialize(fp, s->penalty);
+            deserialize(fp, s->last_penalty);
+        }
+    }
     size_t sz;
+    cid_t id;
     deserialize(fp, sz);
-    for (auto& e : *configurations) delete e;
-    (*configurations).resize(sz);
+    emitted.clear();
     for (size_t i = 0; i < sz; ++i) {
-        (*configurations)[i] = new configuration();
-        deserialize(fp, *(*configurations)[i], options);
+        deserialize(fp, id);
+        emitted.insert(id);
+    }
+    if (decomposed) {
+        deserialize(fp, parts);
+        for (const part& pt : parts) {
+            for (size_t j = 0; j < pt.options.size(); ++j) {
+                if (pt.options[j] >= options.size() || pt.rows.width != pt.options.size()) throw std::runtime_error("corrupt option group");
+                for (size_t r = 0; r < pt.rows.size(); ++r) {
+                    if (pt.rows.row(r)[j] >= options[pt.options[j]]->settings.size()) throw std::runtime_error(strprintf("option group row %zu has invalid setting index for option %s", r, options[pt.options[j]]->name));
+                }
+            }
+        }
     }
+    strength = 0;
+    if (flags & state_covering) deserialize(fp, strength);
+    return true;
 }
 
-bool wc::emit_and_penalize(FILE* stream) {
-    if (!configurations || configurations->size() == 0) return false;
-    auto cfg = configurations->back();
-    cfg->will_emit();
-    configurations->pop_back();
-    for (auto& c : *configurations) c->penalize(*cfg);
-    fprintf(stream, "%s", emits.c_str());
-    cfg->emit(stream);
-    sort();
-    return true;
+std::vector<char> wc::tail() const {
+    char* buf;
+    size_t len;
+    FILE* ms = open_memstream(&buf, &len);
+    if (!ms) throw std::runtime_error(strprintf("open_memstream failed: %s", strerror(errno)));
+    save_schema(ms);
+    save_state(ms);
+    fclose(ms);
+    std::vector<char> v(buf, buf + len);
+    free(buf);
+    return v;
 }
 
-void wc::sort() {
-    std::sort((*configurations).begin(), (*configurations).end(), [](const configuration* a, const configuration* b) { return a->pri < b->pri; });
+void wc::save(FILE* fp) const {
+    const table& t = configurations;
+    std::vector<char> state = tail();
+    scd_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, scd_magic, sizeof(h.magic));
+    h.width = options.size();
+    h.rows = h.capacity = remaining_rows();
+    h.table_offset = sizeof(h);
+    h.state_offset = h.table_offset + table::block_size(h.width, h.capacity);
+    h.journal_offset = h.state_offset + state.size();
+    fwrite(&h, sizeof(h), 1, fp);
+    // emitted rows (accumulate mode) are dropped on the way out
+    for (size_t r = 0; r < t.size(); ++r) if (t.pri[r] != -INFINITY) fwrite(&t.pri[r], sizeof(float), 1, fp);
+    for (size_t r = 0; r < t.size(); ++r) if (t.pri[r] != -INFINITY) fwrite(&t.last_penalty[r], sizeof(float), 1, fp);
+    for (size_t r = 0; r < t.size(); ++r) if (t.pri[r] != -INFINITY) fwrite(t.row(r), sizeof(sidx_t), t.width, fp);
+    fwrite(state.data(), 1, state.size(), fp);
 }
 
-void wc::blur() {
-    for (auto c : *configurations) {
-        c->pri += (frand() - 0.5) / 10;
+/** Checksum of the extents of a write-back (see writeback_trailer). */
+static uint64_t writeback_check(const std::vector<char>& extents) {
+    uint64_t check = extents.size();
+    size_t i;
+    for (i = 0; i + 8 <= extents.size(); i += 8) {
+        uint64_t w;
+        memcpy(&w, &extents[i], 8);
+        check = mix64(check ^ w);
     }
+    for (; i < extents.size(); ++i) check = mix64(check ^ (uint8_t)extents[i]);
+    return check;
 }
 
-void wc::normalize() {
-    float min = 1e99, max = -1e99;
-    for (auto c : *configurations) {
-        c->calc_pri();
-        if (min > c->pri) min = c->pri;
-        if (max < c->pri) max = c->pri;
+/** Add the n bytes at p, which go at offset in the file, to extents. */
+static void add_extent(std::vector<char>& extents, uint64_t offset, const void* p, uint64_t n) {
+    extents.insert(extents.end(), (const char*)&offset, (const char*)&offset + sizeof(offset));
+    extents.insert(extents.end(), (const char*)&n, (const char*)&n + sizeof(n));
+    extents.insert(extents.end(), (const char*)p, (const char*)p + n);
+}
+
+/** Pass each extent of a write-back to write. */
+static void apply_writeback(const std::vector<char>& extents, const std::function<void(uint64_t, const char*, uint64_t)>& write) {
+    uint64_t offset, n;
+    for (size_t pos = 0; pos < extents.size(); pos += n) {
+        if (extents.size() - pos < sizeof(offset) + sizeof(n)) throw std::runtime_error("corrupt write-back");
+        memcpy(&offset, &extents[pos], sizeof(offset));
+        memcpy(&n, &extents[pos + sizeof(offset)], sizeof(n));
+        pos += sizeof(offset) + sizeof(n);
+        if (n > extents.size() - pos) throw std::runtime_error("corrupt write-back");
+        write(offset, &extents[pos], n);
     }
-    float len = max - min;
-    if (len == 0) {
-        for (auto c : *configurations) {
-            c->pri = 0;
+}
+
+/**
+ * Whether the file behind fd ends in a write-back which never finished, and
+ * if so, its extents and trailer.
+ */
+static bool pending_writeback(int fd, std::vector<char>& extents, writeback_trailer& tr) {
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) || !S_ISREG(st.st_mode) || (uint64_t)st.st_size < sizeof(tr)) return false;
+    uint64_t end = st.st_size - sizeof(tr);
+    if (pread(fd, &tr, sizeof(tr), end) != sizeof(tr) || memcmp(tr.magic, writeback_magic, sizeof(tr.magic))
+        || tr.length > end || tr.size > end - tr.length) {
+        return false;
+    }
+    extents.resize(tr.length);
+    if (pread(fd, extents.data(), tr.length, end - tr.length) != (ssize_t)tr.length) return false;
+    return writeback_check(extents) == tr.check;
+}
+
+/**
+ * Write the extents of a write-back where they belong, and cut the file
+ * (and the write-back after it) off at size.
+ */
+static void finish_writeback(int fd, const std::vector<char>& extents, uint64_t size) {
+    apply_writeback(extents, [&](uint64_t offset, const char* p, uint64_t n) {
+        if (pwrite(fd, p, n, offset) != (ssize_t)n) throw std::runtime_error(strprintf("write failed: %s", strerror(errno)));
+    });
+    if (fdatasync(fd) || ftruncate(fd, size) || fdatasync(fd)) throw std::runtime_error(strprintf("write failed: %s", strerror(errno)));
+}
+
+void wc::load(FILE* fp) {
+    std::vector<char> extents;
+    writeback_trailer tr;
+    if (pending_writeback(fileno(fp), extents, tr)) {
+        // read the file as it is once the write-back is finished, and leave
+        // finishing it to whoever writes to it next
+        std::vector<char> image(tr.size);
+        if (pread(fileno(fp), image.data(), image.size(), 0) != (ssize_t)image.size()) throw std::runtime_error(strprintf("read failed: %s", strerror(errno)));
+        apply_writeback(extents, [&](uint64_t offset, const char* p, uint64_t n) {
+            if (offset > image.size() || n > image.size() - offset) throw std::runtime_error("corrupt write-back");
+            memcpy(&image[offset], p, n);
+        });
+        FILE* ms = fmemopen(image.data(), image.size(), "rb");
+        if (!ms) throw std::runtime_error(strprintf("fmemopen failed: %s", strerror(errno)));
+        load(ms);
+        fclose(ms);
+        return;
+    }
+    scd_header h;
+    if (fread(h.magic, sizeof(h.magic), 1, fp) != 1 || memcmp(h.magic, scd_magic, sizeof(h.magic))) {
+        rewind(fp);
+        load_v1(fp);
+    } else {
+        if (fread(&h.width, sizeof(h) - sizeof(h.magic), 1, fp) != 1) throw std::runtime_error("truncated .scd header");
+        fseek(fp, h.state_offset, SEEK_SET);
+        load_schema(fp);
+        load_state(fp);
+        check_header(h);
+        configurations = table(h.width);
+        table& t = configurations;
+        t.reserve(h.rows);
+        t.rows = h.rows;
+        fseek(fp, h.table_offset, SEEK_SET);
+        if (fread(t.pri, sizeof(float), t.rows, fp) != t.rows) throw std::runtime_error("truncated configuration table");
+        fseek(fp, h.table_offset + h.capacity * sizeof(float), SEEK_SET);
+        if (fread(t.last_penalty, sizeof(float), t.rows, fp) != t.rows) throw std::runtime_error("truncated configuration table");
+        fseek(fp, h.table_offset + 2 * h.capacity * sizeof(float), SEEK_SET);
+        if (fread(t.cells, sizeof(sidx_t) * t.width, t.rows, fp) != t.rows) throw std::runtime_error("truncated configuration table");
+        for (size_t r = 0; r < t.rows; ++r) {
+            for (size_t i = 0; i < t.width; ++i) {
+                if (t.row(r)[i] >= options[i]->settings.size()) throw std::runtime_error(strprintf("configuration %zu has invalid setting index %u for option %s", r, t.row(r)[i], options[i]->name));
+            }
+        }
+        std::vector<char> records;
+        if (journaled && h.journal_offset) {
+            char buf[4096];
+            size_t n;
+            fseek(fp, h.journal_offset, SEEK_SET);
+            while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) records.insert(records.end(), buf, buf + n);
         }
+        replay_journal(records, h.journal_offset);
+    }
+    if (lazy) matrix = compat_matrix(options);
+}
+
+void wc::load_v1(FILE* fp) {
+    load_schema(fp);
+    configurations = table(options.size());
+    size_t sz, width, v;
+    float pri, last_penalty;
+    deserialize(fp, sz);
+    configurations.reserve(sz);
+    std::vector<sidx_t> buf(options.size());
+    for (size_t r = 0; r < sz; ++r) {
+        deserialize(fp, width);
+        if (width != options.size()) throw std::runtime_error(strprintf("configuration %zu has %zu settings (expected %zu)", r, width, options.size()));
+        for (size_t i = 0; i < width; ++i) {
+            deserialize(fp, v);
+            if (v >= options[i]->settings.size()) throw std::runtime_error(strprintf("configuration %zu has invalid setting index %zu for option %s", r, v, options[i]->name));
+            buf[i] = v;
+        }
+        deserialize(fp, pri);
+        deserialize(fp, last_penalty);
+        configurations.push_back(buf.data(), pri, last_penalty);
+    }
+    // without a state block, this was written by an older compiler, which
+    // sorted the table in ascending order
+    if (!load_state(fp) || !accumulate) configurations.heapify();
+}
+
+void wc::check_header(const scd_header& h) const {
+    if (h.width != options.size()) throw std::runtime_error(strprintf(".scd table has %llu columns (expected %zu)", (unsigned long long)h.width, options.size()));
+    if (h.rows > h.capacity || h.table_offset < sizeof(scd_header) || h.table_offset % sizeof(float)
+        || h.table_offset + table::block_size(h.width, h.capacity) > h.state_offset) {
+        throw std::runtime_error("corrupt .scd header");
+    }
+}
+
+void wc::write_back(int fd, const std::vector<char>& extents, uint64_t size) {
+    // the extents go past the end of the file (and whatever an interrupted
+    // write-back left there) first, so the trailer ends the file
+    struct stat st;
+    writeback_trailer tr;
+    tr.length = extents.size();
+    tr.size = size;
+    tr.check = writeback_check(extents);
+    memcpy(tr.magic, writeback_magic, sizeof(tr.magic));
+    if (fstat(fd, &st)) throw std::runtime_error(strprintf("stat failed: %s", strerror(errno)));
+    uint64_t at = std::max<uint64_t>(st.st_size, size);
+    if (pwrite(fd, extents.data(), extents.size(), at) != (ssize_t)extents.size()
+        || pwrite(fd, &tr, sizeof(tr), at + extents.size()) != sizeof(tr) || fdatasync(fd)) {
+        throw std::runtime_error(strprintf("write failed: %s", strerror(errno)));
+    }
+    finish_writeback(fd, extents, size);
+}
+
+bool wc::map(FILE* fp) {
+    int fd = fileno(fp);
+    scd_header h;
+    struct stat st;
+    std::vector<char> extents;
+    writeback_trailer tr;
+    if (pending_writeback(fd, extents, tr)) {
+        // finish what an interrupted store() started
+        finish_writeback(fd, extents, tr.size);
+    }
+    if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, scd_magic, sizeof(h.magic))) return false;
+    if (fstat(fd, &st) || h.state_offset >= (uint64_t)st.st_size || h.journal_offset > (uint64_t)st.st_size
+        || (h.journal_offset && h.journal_offset < h.state_offset)) {
+        throw std::runtime_error("corrupt .scd header");
+    }
+    // only the schema, state and journal are read; the table is used where it lies
+    std::vector<char> rest(st.st_size - h.state_offset);
+    if (pread(fd, rest.data(), rest.size(), h.state_offset) != (ssize_t)rest.size()) throw std::runtime_error(strprintf("read failed: %s", strerror(errno)));
+    size_t state_size = h.journal_offset ? h.journal_offset - h.state_offset : rest.size();
+    FILE* ts = fmemopen(rest.data(), state_size, "rb");
+    if (!ts) throw std::runtime_error(strprintf("fmemopen failed: %s", strerror(errno)));
+    load_schema(ts);
+    load_state(ts);
+    fclose(ts);
+    check_header(h);
+    // the pages are mapped copy-on-write, so nothing reaches the file before
+    // store() writes it back (or appends it to the journal)
+    void* p = mmap(nullptr, h.state_offset, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) throw std::runtime_error(strprintf("mmap failed: %s", strerror(errno)));
+    mapped = (char*)p;
+    mapped_size = h.state_offset;
+    configurations = table(h.width);
+    configurations.attach(mapped + h.table_offset, h.rows, h.capacity);
+    if (lazy) matrix = compat_matrix(options);
+    // past the state of a file which is not journaled, there can only be
+    // what a write-back which never finished left behind
+    replay_journal(journaled ? std::vector<char>(rest.begin() + state_size, rest.end()) : std::vector<char>(), h.journal_offset);
+    return true;
+}
+
+void wc::store(FILE* fp) {
+    int fd = fileno(fp);
+    if (!mapped) {
+        char* buf;
+        size_t len;
+        FILE* ms = open_memstream(&buf, &len);
+        if (!ms) throw std::runtime_error(strprintf("open_memstream failed: %s", strerror(errno)));
+        save(ms);
+        fclose(ms);
+        std::vector<char> extents;
+        add_extent(extents, 0, buf, len);
+        free(buf);
+        write_back(fd, extents, len);
+        return;
+    }
+    if (journaled) {
+        // drop whatever an interrupted append may have left behind first
+        size_t len = pending.size() * sizeof(journal_record);
+        if (ftruncate(fd, journal_end) || pwrite(fd, pending.data(), len, journal_end) != (ssize_t)len || fdatasync(fd)) {
+            throw std::runtime_error(strprintf("journal append failed: %s", strerror(errno)));
+        }
+        journal_end += len;
+        journal_length += pending.size();
+        pending.clear();
+        return;
+    }
+    // the header, what changed in the table, and the schema and state, which
+    // may have changed size (lazy mode)
+    table& t = configurations;
+    scd_header* h = (scd_header*)mapped;
+    h->rows = t.size();
+    std::vector<char> state = tail();
+    h->journal_offset = h->state_offset + state.size();
+    std::vector<char> extents;
+    add_extent(extents, 0, h, sizeof(*h));
+    if (table_dirty) {
+        add_extent(extents, (char*)t.pri - mapped, t.pri, t.size() * sizeof(float));
+        add_extent(extents, (char*)t.last_penalty - mapped, t.last_penalty, t.size() * sizeof(float));
+        add_extent(extents, (char*)t.cells - mapped, t.cells, t.size() * t.width * sizeof(sidx_t));
     } else {
-        // adjust to 0..1
-        float add = -min;
-        for (auto c : *configurations) {
-            c->pri = (c->pri + add) / len;
+        for (size_t r : dirty_rows) add_extent(extents, (char*)&t.pri[r] - mapped, &t.pri[r], sizeof(float));
+    }
+    add_extent(extents, h->state_offset, state.data(), state.size());
+    write_back(fd, extents, h->journal_offset);
+    table_dirty = false;
+    dirty_rows.clear();
+}
+
+bool wc::needs_compaction() const {
+    // replaying a record is cheap, except in plain table mode, where it
+    // penalizes the whole table
+    return journal_length + pending.size() >= (lazy || accumulate || decomposed ? 1024 : 16);
+}
+
+void wc::compact(const char* path) {
+    // the new snapshot replaces the old one in a single rename, so a crash
+    // leaves either the old snapshot and journal or the new snapshot
+    std::string tmp = strprintf("%s.tmp", path);
+    FILE* fp = fopen(tmp.c_str(), "wb");
+    if (!fp) throw std::runtime_error(strprintf("unable to open file: %s", tmp));
+    save(fp);
+    if (fflush(fp) || fsync(fileno(fp))) throw std::runtime_error(strprintf("write failed: %s", strerror(errno)));
+    fclose(fp);
+    if (rename(tmp.c_str(), path)) throw std::runtime_error(strprintf("rename failed: %s", strerror(errno)));
+    journal_length = 0;
+    pending.clear();
+}
+
+void wc::replay_journal(const std::vector<char>& records, uint64_t offset) {
+    journal_length = 0;
+    journal_end = offset;
+    for (size_t pos = 0; pos + sizeof(journal_record) <= records.size(); pos += sizeof(journal_record)) {
+        journal_record rec;
+        memcpy(&rec, &records[pos], sizeof(rec));
+        if (rec.check != rec.calc_check()) break;
+        replay(rec);
+        ++journal_length;
+        journal_end += sizeof(rec);
+    }
+}
+
+void wc::replay(const journal_record& rec) {
+    std::vector<sidx_t> row(options.size());
+    if (lazy || decomposed) {
+        if (emitted.count(rec.id)) throw std::runtime_error(strprintf("journal record %zu does not match the instance", journal_length));
+        decode(rec.id, row.data());
+    } else {
+        if (rec.r >= configurations.size() || configurations.pri[rec.r] == -INFINITY || (!accumulate && rec.r != 0)) {
+            throw std::runtime_error(strprintf("journal record %zu does not match the instance", journal_length));
         }
+        memcpy(row.data(), configurations.row(rec.r), configurations.width * sizeof(sidx_t));
     }
+    if (id_of(row.data()) != rec.id) throw std::runtime_error(strprintf("journal record %zu does not match the instance", journal_length));
+    settle(rec.r, row.data());
+}
+
+void wc::will_emit(const sidx_t* row) {
+    for (option* o : options) {
+        for (setting* s : o->settings) s->last_penalty = 0;
+    }
+    for (size_t i = 0; i < options.size(); ++i) {
+        setting* s = si(row, i);
+        ++s->inclusions;
+        s->last_penalty = s->calc_penalty();
+        s->penalty += s->last_penalty;
+    }
+}
+
+float wc::calc_pri(const sidx_t* row) const {
+    float pri = 0;
+    for (size_t i = 0; i < options.size(); ++i) {
+        pri += si(row, i)->priority;
+    }
+    return pri;
+}
+
+void wc::penalize(const sidx_t* basis) {
+    // will_emit() worked out the penalty for each setting in basis; a row
+    // only ever picks up the penalty of a setting it shares with basis
+    std::vector<float> pen(options.size());
+    for (size_t i = 0; i < options.size(); ++i) pen[i] = si(basis, i)->last_penalty;
+    static const penalty_kernel kernel = select_penalty_kernel();
+    parallel_rows(configurations.size(), threads, [&](size_t, size_t lo, size_t hi) {
+        kernel(configurations, lo, hi, basis, pen.data());
+    });
+}
+
+void wc::emit_row(const sidx_t* row, FILE* fp) const {
+    for (size_t i = 0; i < options.size(); ++i) {
+        options[i]->emit(row[i], fp);
+    }
+}
+
+std::string wc::to_string(const sidx_t* row) const {
+    std::string r = "";
+    for (size_t i = 0; i < options.size(); ++i) {
+        r += (r == "" ? "" : ", ") + options[i]->name + "=" + si(row, i)->value;
+    }
+    return r;
+}
+
+bool wc::take(sidx_t* row) {
+    size_t r = 0;
+    if (lazy) {
+        if (!find_lazy(row)) return false;
+    } else if (decomposed) {
+        if (!find_composite(row)) return false;
+    } else if (accumulate) {
+        if (!find_accumulated(r)) return false;
+        memcpy(row, configurations.row(r), configurations.width * sizeof(sidx_t));
+    } else {
+        if (configurations.size() == 0) return false;
+        memcpy(row, configurations.row(0), configurations.width * sizeof(sidx_t));
+    }
+    settle(r, row);
+    if (journaled) pending.push_back(journal_record(id_of(row), r));
+    return true;
+}
+
+void wc::settle(size_t r, const sidx_t* row) {
+    // row (taken from table row r, unless lazy or decomposed) has been emitted
+    will_emit(row);
+    if (lazy || decomposed) {
+        emitted.insert(id_of(row));
+    } else {
+        retire(r, row);
+    }
+}
+
+void wc::retire(size_t r, const sidx_t* row) {
+    if (accumulate) {
+        configurations.pri[r] = -INFINITY;
+        if (mapped) dirty_rows.push_back(r);
+        while (configurations.size() && configurations.pri[configurations.size() - 1] == -INFINITY) configurations.pop_back();
+        return;
+    }
+    configurations.pop_front();
+    table_dirty = true;
+    // heapify() sifts rows down bottom-up, so each row is sifted into heaps
+    // which are already valid, and whose rows have all been penalized; this
+    // is the same as penalizing and sifting one row at a time
+    penalize(row);
+    configurations.heapify(threads);
+}
+
+bool wc::emit_and_penalize(FILE* stream) {
+    std::vector<sidx_t> row(options.size());
+    if (!take(row.data())) return false;
+    fprintf(stream, "%s", emits.c_str());
+    emit_row(row.data(), stream);
+    return true;
+}
+
+void wc::blur() {
+    // hashed from the configuration id, as in lazy_pri(), so the result does
+    // not depend on which thread gets to which row first
+    size_t rows = configurations.size();
+    parallel_rows(rows, threads, [&](size_t, size_t lo, size_t hi) {
+        for (size_t r = lo; r < hi; ++r) {
+            configurations.pri[r] += (hrand(seed, id_of(configurations.row(r))) - 0.5) / 10;
+        }
+    });
+}
+
+void wc::normalize() {
+    float* pri = configurations.pri;
+    size_t rows = configurations.size();
+    std::vector<float> mins(threads, 1e99), maxs(threads, -1e99);
+    base_min = base_len = 0;
+    parallel_rows(rows, threads, [&](size_t c, size_t lo, size_t hi) {
+        for (size_t r = lo; r < hi; ++r) {
+            pri[r] = calc_pri(configurations.row(r));
+            if (mins[c] > pri[r]) mins[c] = pri[r];
+            if (maxs[c] < pri[r]) maxs[c] = pri[r];
+        }
+    });
+    float min = *std::min_element(mins.begin(), mins.end());
+    float max = *std::max_element(maxs.begin(), maxs.end());
+    float len = max - min;
+    if (rows) {
+        base_min = min;
+        base_len = len;
+    }
+    parallel_rows(rows, threads, [&](size_t, size_t lo, size_t hi) {
+        for (size_t r = lo; r < hi; ++r) {
+            // adjust to 0..1
+            pri[r] = len == 0 ? 0 : (pri[r] - min) / len;
+        }
+    });
 }
 
 void wc::emit(const std::string& output) {
@@ -257,15 +2060,16 @@ void wc::emit(const std::string& output) {
 
 void wc::branch(const std::string& desc, const std::string& var, const std::string& val, const std::string& emits, int priority, std::vector<we::restricter*> conditions) {
     std::vector<req*> conds;
-    req::convert_we(conds, conditions);
-    setting* s = new setting(val, emits, conds, priority);
+    req::convert_we(conds, conditions, pool);
+    setting* s = pool.make<setting>(val, emits, conds, priority);
     settings.push_back(s);
     if (option_map.count(var)) {
         option* opt = option_map.at(var);
         opt->settings.push_back(s);
     } else {
         std::vector<setting*> sv{s};
-        option* opt = new option(var, "", sv);
+        option* opt = pool.make<option>(var, "", sv);
+        opt->id = options.size();
         options.push_back(opt);
         option_map[var] = opt;
     }
@@ -3,14 +3,29 @@
 
 #include <tinyformat.h>
 #include <we.h>
+#include <arena.h>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <cstdlib>
+#include <ctime>
+#include <limits>
 #include <set>
 #include <vector>
 
-inline float frand() {
-    static bool srand_called = false;
-    if (!srand_called) { srand_called = true; srand(time(NULL)); }
-    return (float)rand() / RAND_MAX;
+/**
+ * Counter-based random numbers (SplitMix64): hrand() is a value in [0..1]
+ * which is a pure function of (seed, ctr), so the same counter always yields
+ * the same value, whichever thread asks and in whatever order.
+ */
+inline uint64_t mix64(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+inline float hrand(uint64_t seed, uint64_t ctr) {
+    return (float)(mix64(seed + (ctr + 1) * 0x9e3779b97f4a7c15ULL) >> 40) / (1 << 24);
 }
 
 /**
@@ -29,11 +44,11 @@ D(float)
 D(tiny::token_type)
 D(int)
 D(uint32_t)
+D(uint16_t)
 
 struct req;
 struct setting;
 struct option;
-struct configuration;
 
 inline void serialize(FILE* fp, const std::string& s) { serialize(fp, s.size()); fwrite(s.c_str(), s.size(), 1, fp); /*printf("[ser %06ld] (string) %s\n", ftell(fp), s.c_str());*/ }
 inline std::string deserialize_string(FILE* fp) { size_t sz; deserialize(fp, sz); char buf[sz + 1]; buf[sz] = 0; fread(buf, sz, 1, fp); /*printf("[des %06ld] (string) %s\n", ftell(fp), buf);*/ return buf; }
@@ -46,7 +61,7 @@ template<typename T> inline void serialize(FILE* fp, const std::vector<T>& v) {
 template<typename T> inline void deserialize(FILE* fp, std::vector<T>& v) { size_t sz; deserialize(fp, sz); v.resize(sz); for (size_t i = 0; i < sz; ++i) deserialize(fp, v[i]); }
 
 #define vpser(fp, v) serialize(fp, (v).size()); for (const auto& e : (v)) serialize(fp, *e)
-#define vpdes(fp, v, T) do { size_t sz; deserialize(fp, sz); for (auto& e : v) delete e; (v).resize(sz); for (size_t i = 0; i < sz; ++i) { (v)[i] = new T(); deserialize(fp, *(v)[i]); } } while (0)
+#define vpdes(fp, v, T, a) do { size_t sz; deserialize(fp, sz); (v).resize(sz); for (size_t i = 0; i < sz; ++i) { (v)[i] = (a).make<T>(); deserialize(fp, *(v)[i], a); } } while (0)
 // template<typename T> inline void serialize(FILE* fp, const std::vector<T*>& v) { serialize(fp, v.size()); for (const auto& e : v) serialize(fp, *e); }
 // template<typename T> inline void deserialize(FILE* fp, std::vector<T*>& v) { size_t sz; deserialize(fp, sz); for (auto& e : v) delete e; v.resize(sz); for (size_t i = 0; i < sz; ++i) { v[i] = new T(); deserialize(fp, v[i]); } }
 
@@ -55,9 +70,8 @@ struct req {
     tiny::token_type cond;
     req();
     req(const std::string& var_in, const std::string& val_in, tiny::token_type cond_in);
-    bool met(const std::map<std::string,std::string>& state, const std::string& x_var = "", const std::string& x_val = "") const;
-    static void convert_we(std::vector<req*>& v, const std::vector<we::restricter*>& rest);
-    static bool met(const std::map<std::string,std::string>& state, const std::vector<req*>& requirements, const std::string& x_var = "", const std::string& x_val = "");
+    inline bool holds(const std::string& value) const { return (value == val) == (cond == tiny::tok_eq); }
+    static void convert_we(std::vector<req*>& v, const std::vector<we::restricter*>& rest, arena& a);
 };
 
 inline void serialize(FILE* fp, const req& r) {
@@ -72,15 +86,20 @@ inline void deserialize(FILE* fp, req& r) {
     deserialize(fp, r.cond);
 }
 
+inline void deserialize(FILE* fp, req& r, arena&) { deserialize(fp, r); }
+
 struct setting {
     size_t inclusions = 0;
     size_t occurrences = 0;
+    float penalty = 0;      // accumulated over all emissions including this setting
+    float last_penalty = 0; // penalty applied by the last emission (0 if not included)
     std::string value;
     std::string emits;
     std::vector<req*> requirements;
     int priority;
     setting();
     setting(const std::string& value_in, const std::string& emits_in, const std::vector<req*>& requirements_in, int priority_in);
+    float calc_penalty() const;
 };
 
 inline void serialize(FILE* fp, const setting& s) {
@@ -92,18 +111,17 @@ inline void serialize(FILE* fp, const setting& s) {
     serialize(fp, s.occurrences);
 }
 
-inline void deserialize(FILE* fp, setting& s) {
+inline void deserialize(FILE* fp, setting& s, arena& a) {
     s.value = deserialize_string(fp);
     s.emits = deserialize_string(fp);
-    vpdes(fp, s.requirements, req);
+    vpdes(fp, s.requirements, req, a);
     deserialize(fp, s.priority);
     deserialize(fp, s.inclusions);
     deserialize(fp, s.occurrences);
 }
 
 struct option {
-    static uint32_t id_counter;
-    uint32_t id = 0;
+    uint32_t id = 0; // position in wc::options
     std::string name;
     std::string emits;
     std::vector<setting*> settings;
@@ -119,73 +137,588 @@ inline void serialize(FILE* fp, const option& o) {
     vpser(fp, o.settings);
 }
 
-inline void deserialize(FILE* fp, option& o) {
+inline void deserialize(FILE* fp, option& o, arena& a) {
     deserialize(fp, o.id);
     o.name = deserialize_string(fp);
     o.emits = deserialize_string(fp);
-    vpdes(fp, o.settings, setting);
+    vpdes(fp, o.settings, setting, a);
 }
 
-struct configuration {
-    std::vector<option*> options;
-    std::map<std::string,std::string> state;
-    std::vector<size_t> setting_index;
-    std::vector<req*> requirements;
-    size_t old_idx;
-    float pri = 0;
-    float last_penalty = 0;
-    inline setting* si(size_t i) const { return options[i]->settings[setting_index[i]]; }
-    inline setting* si(size_t i) { return options[i]->settings[setting_index[i]]; }
-    configuration();
-    configuration(const std::vector<option*>& options_in, const std::map<std::string,std::string>& state_in, const std::vector<size_t>& setting_index_in, const std::vector<req*> requirements_in, option* opt, size_t sidx, std::vector<req*> reqs);
-    void will_emit();
-    void calc_pri();
-    void branch(std::vector<configuration*>* config_pool, option* opt);
-    static void begin(std::vector<configuration*>* config_pool, option* opt);
-    std::string to_string() const;
-    void penalize(const configuration& basis);
-    void emit(FILE* fp) const;
+/**
+ * Index of a setting within its option. Configurations are stored as rows of
+ * these, one per option, so this bounds the number of settings per option.
+ */
+typedef uint16_t sidx_t;
+
+/**
+ * Placeholder for a setting index not decided yet, in partial configurations.
+ */
+static const sidx_t free_cell = std::numeric_limits<sidx_t>::max();
+
+/**
+ * Configuration id: the setting indices of a configuration read as a
+ * mixed-radix number, with the first option as the most significant digit.
+ */
+typedef uint64_t cid_t;
+
+/**
+ * Configuration table.
+ * All configurations are kept in one contiguous block: a dense column each for
+ * priority and last penalty, followed by a row-major array of setting indices
+ * (one row per configuration, one column per option), each with room for
+ * capacity rows. The options themselves are only referenced from the owning
+ * wc::wc.
+ *
+ * The block is either owned by the table or attached from elsewhere (a mapped
+ * .scd file, which stores the table in the same layout); an attached table can
+ * shrink, but not grow past its capacity.
+ *
+ * An instance keeps its table as a binary max-heap on pri, so row 0 is always
+ * the next configuration to emit. Lowering the priority of row i and calling
+ * sift_down(i) is the decrease-key operation.
+ */
+struct table {
+    size_t width;
+    size_t rows = 0;
+    size_t capacity = 0;
+    float* pri = nullptr;
+    float* last_penalty = nullptr;
+    sidx_t* cells = nullptr;
+    char* block = nullptr;
+    bool owned = true;
+    table(size_t width_in = 0) : width(width_in) {}
+    table(const table& t);
+    table(table&& t);
+    ~table();
+    table& operator=(table t);
+    inline static size_t block_size(size_t width, size_t capacity) { return capacity * (2 * sizeof(float) + width * sizeof(sidx_t)); }
+    inline size_t size() const { return rows; }
+    inline sidx_t* row(size_t r) { return cells + r * width; }
+    inline const sidx_t* row(size_t r) const { return cells + r * width; }
+    void attach(char* block_in, size_t rows_in, size_t capacity_in);
+    void reserve(size_t n);
+    void push_back(const sidx_t* r, float pri_in = 0, float last_penalty_in = 0);
+    void pop_back();
+    void clear();
+    void permute(const std::vector<size_t>& order);
+    void sort();
+    /**
+     * Drop all but the k rows of highest priority, which are left in no
+     * particular order. Takes time linear in the number of rows.
+     */
+    void keep_top(size_t k);
+    void swap_rows(size_t a, size_t b);
+    void sift_down(size_t i);
+    void heapify(size_t threads = 1);
+    void pop_front();
 };
 
-inline void serialize(FILE* fp, const configuration& c) {
-    serialize(fp, c.setting_index);
-    serialize(fp, c.pri);
-    serialize(fp, c.last_penalty);
+inline void serialize(FILE* fp, const table& t) {
+    serialize(fp, t.width);
+    serialize(fp, t.size());
+    fwrite(t.pri, sizeof(float), t.size(), fp);
+    fwrite(t.last_penalty, sizeof(float), t.size(), fp);
+    fwrite(t.cells, sizeof(sidx_t), t.size() * t.width, fp);
 }
 
-inline void deserialize(FILE* fp, configuration& c, const std::vector<option*>& options) {
-    c.options = options;
-    deserialize(fp, c.setting_index);
-    deserialize(fp, c.pri);
-    deserialize(fp, c.last_penalty);
+inline void deserialize(FILE* fp, table& t) {
+    size_t rows;
+    deserialize(fp, t.width);
+    deserialize(fp, rows);
+    t = table(t.width);
+    t.reserve(rows);
+    t.rows = rows;
+    if (fread(t.pri, sizeof(float), rows, fp) != rows
+        || fread(t.last_penalty, sizeof(float), rows, fp) != rows
+        || fread(t.cells, sizeof(sidx_t) * t.width, rows, fp) != rows) {
+        throw std::runtime_error("truncated table");
+    }
 }
 
+/**
+ * Independent group of options (decompose mode): a set of options none of
+ * which has requirements in common with an option outside the set, with the
+ * acceptable combinations of their settings. The configurations of the
+ * instance are all combinations of one row from each part.
+ */
+struct part {
+    std::vector<size_t> options; // indices into wc::options, ascending
+    table rows;                  // one column per option above; pri is the base priority
+};
+
+inline void serialize(FILE* fp, const part& p) {
+    serialize(fp, p.options);
+    serialize(fp, p.rows);
+}
+
+inline void deserialize(FILE* fp, part& p) {
+    deserialize(fp, p.options);
+    deserialize(fp, p.rows);
+}
+
+/**
+ * Setting compatibility matrix.
+ * Settings are numbered option by option, and each one gets a bitset of all
+ * settings it may be combined with. The requirements are compiled into these
+ * once, so a partial configuration narrows down the settings still allowed
+ * with one AND per word for each setting it picks, and checking a candidate
+ * is a single bit test.
+ */
+struct compat_matrix {
+    size_t words = 0;             // 64-bit words per bitset
+    std::vector<size_t> base;     // number of the first setting of each option
+    std::vector<uint64_t> bits;   // one bitset per setting
+    std::vector<uint64_t> alive;  // settings not ruled out by their own requirements
+    compat_matrix() {}
+    compat_matrix(const std::vector<option*>& options);
+    inline const uint64_t* mask(size_t g) const { return &bits[g * words]; }
+    inline static bool test(const uint64_t* set, size_t g) { return (set[g >> 6] >> (g & 63)) & 1; }
+    inline void narrow(uint64_t* dst, const uint64_t* src, size_t g) const {
+        const uint64_t* m = mask(g);
+        for (size_t w = 0; w < words; ++w) dst[w] = src[w] & m[w];
+    }
+    /**
+     * Whether row, which has a setting for every option, is acceptable.
+     */
+    bool accepts(const sidx_t* row) const;
+};
+
+/**
+ * Unsigned integer of any size, for counting combinations of specifications
+ * far too large to enumerate. Only what counting needs is supported.
+ */
+struct bigcount {
+    std::vector<uint32_t> limbs; // least significant first, no trailing zeros
+    bigcount(uint64_t v = 0);
+    bigcount& operator+=(const bigcount& b);
+    bigcount operator*(uint64_t m) const;
+    inline bool zero() const { return limbs.empty(); }
+    bool fits(size_t& out) const;
+    double to_double() const;
+    std::string to_string() const;
+};
+
+/**
+ * Result of counting (see wc::count()): the number of acceptable
+ * configurations, and the range of their (pre-normalization) priority.
+ */
+struct census {
+    bigcount total;
+    int min_pri = 0, max_pri = 0;
+};
+
+/**
+ * Instance state. Written after the configuration table, which keeps the
+ * file readable by older executors; the magic tells us whether it exists.
+ */
+static const uint32_t state_magic = 0x58435057; // "WPCX"
+
+enum state_flags: uint32_t {
+    state_lazy = 1,       // configurations are enumerated on demand, not stored
+    state_accumulate = 2, // penalties are derived from per-setting totals
+    state_journal = 4,    // emissions are appended to a journal (see journal_record)
+    state_decompose = 8,  // independent option groups are stored apart (see part)
+    state_covering = 16,  // the table is a covering array (see wc::cover())
+};
+
+/**
+ * .scd v2 layout: the header below, the configuration table block (see table)
+ * at table_offset, the schema and instance state from state_offset, and the
+ * journal from journal_offset to the end of the file. The state is the only
+ * part which changes size once the file is written, so it goes last (before
+ * the journal, which is only ever appended to), and an executor can map
+ * everything before it and update the table in place.
+ *
+ * v1 files have no header; they begin with the schema, followed by the table
+ * as a serialized stream, and then the state.
+ */
+static const char scd_magic[8] = {'W', 'P', 'C', 'S', 'C', 'D', '0', '2'};
+
+struct scd_header {
+    char magic[8];
+    uint64_t width;        // options per configuration
+    uint64_t rows;         // configurations in the table
+    uint64_t capacity;     // rows the table block has room for
+    uint64_t table_offset;
+    uint64_t state_offset;
+    uint64_t journal_offset; // end of the state; 0 in files without a journal
+    uint64_t reserved;
+};
+
+/**
+ * Journal record. Journaled instances are not rewritten on emission; instead
+ * each emitted configuration is appended as one of these, and loading replays
+ * them over the snapshot in the order they were written. A record which is
+ * cut short or fails its check (a write interrupted by a crash) ends the
+ * journal, so the snapshot is never left half updated.
+ */
+struct journal_record {
+    cid_t id;       // the emitted configuration
+    uint32_t r;     // the row it was taken from (accumulate mode)
+    uint32_t check;
+    journal_record() {}
+    journal_record(cid_t id_in, uint32_t r_in) : id(id_in), r(r_in), check(calc_check()) {}
+    inline uint32_t calc_check() const { return mix64(id ^ mix64(r)) >> 32; }
+};
+
+/**
+ * Write-back trailer. Instances which are not journaled are still written
+ * back in place, but not directly: store() first appends the extents it is
+ * about to write (each an offset and a length, followed by the bytes) and
+ * then this trailer past the end of the file, and only writes them where
+ * they belong once that is on disk. Opening the file finishes a write-back
+ * whose trailer checks out, and ignores one which does not, so the file is
+ * always either as it was before store() or as it is after.
+ */
+static const char writeback_magic[8] = {'W', 'P', 'C', 'W', 'B', 'A', 'C', 'K'};
+
+struct writeback_trailer {
+    uint64_t length; // bytes of extents before the trailer
+    uint64_t size;   // of the file once the extents are written
+    uint64_t check;
+    char magic[8];
+};
+
+struct wc;
+
+/**
+ * Correspondence between the options and settings of an instance and those of
+ * an earlier instance of the same specification, which it carries the
+ * progress of over (see wc::wc(env, previous)). Options are matched by name,
+ * and settings by value. A setting which also has the same requirements as
+ * before is kept: it rules out exactly the same combinations as it did.
+ */
+struct lineage {
+    const wc& previous;
+    std::vector<size_t> options;               // option of previous for each option, or SIZE_MAX
+    std::vector<std::vector<sidx_t>> settings; // setting of previous for each setting, or free_cell
+    std::vector<std::vector<sidx_t>> images;   // the other way around, for each matched option
+    std::vector<std::vector<bool>> kept;
+    bool one_to_one = false; // the options of both correspond one to one
+    bool aligned = false;    // ... and are in the same order
+    lineage(const wc& previous_in, const std::vector<option*>& next);
+    /**
+     * Translate a configuration of previous into one of ours, or the other
+     * way around. Returns false if it has no counterpart.
+     */
+    bool from_previous(const sidx_t* row, sidx_t* out) const;
+    bool to_previous(const sidx_t* row, sidx_t* out) const;
+    /**
+     * The part of previous with the options opts (aligned only), if none of
+     * them has changed at all, or nullptr.
+     */
+    const part* unchanged(const std::vector<size_t>& opts) const;
+};
+
 struct wc: public we::configurator {
-    size_t total_combinations;
+    // options, settings and requirements are allocated from here, and live
+    // as long as the instance
+    arena pool;
+    size_t total_combinations = 0;
     std::string emits;
     std::vector<setting*> settings;
     std::vector<option*> options;
     std::map<std::string,option*> option_map;
-    std::vector<configuration*>* configurations;
+    table configurations;
+
+    // threads used to build the configurations (expansion, counting and
+    // normalization) and to penalize and re-heap the table on emission; the
+    // result does not depend on it
+    size_t threads = 1;
+
+    // lazy mode: configurations are never materialized; the space is walked
+    // as a mixed-radix number over the options' settings instead, and only
+    // the ids of emitted configurations and per-setting penalties are kept
+    bool lazy = false;
+    // accumulate mode: the table keeps the base priority of each row, sorted
+    // in ascending order, and a row's current priority is its base minus the
+    // penalty totals of its settings (which is all that penalize() would have
+    // taken off it); emitted rows are left in place with a pri of -inf
+    bool accumulate = false;
+    // decompose mode: the options are split into independent parts, which
+    // each keep a table of their own, and configurations are composed from
+    // one row of each on demand; penalties are accumulated as above, and
+    // emitted configurations are kept by id as in lazy mode
+    bool decomposed = false;
+    std::vector<part> parts;
+    // covering arrays: the strength the table was generated with (0 if it
+    // has every configuration)
+    size_t strength = 0;
+    uint64_t seed = 0; // keys all blur noise (see hrand())
+    float base_min = 0, base_len = 0;
+    std::set<cid_t> emitted;
+
+    compat_matrix matrix;
+
+    // in-place mode: the table is attached to a private mapping of the file
+    // it was loaded from, covering the header and the table block, and
+    // store() writes back what changed (the whole table once it has been
+    // penalized, otherwise just the priorities of the rows taken)
+    char* mapped = nullptr;
+    size_t mapped_size = 0;
+    bool table_dirty = false;
+    std::vector<size_t> dirty_rows;
+
+    // journal mode: records on file (and where they end), and records for
+    // emissions since the instance was loaded, which store() appends
+    bool journaled = false;
+    size_t journal_length = 0;
+    uint64_t journal_end = 0;
+    std::vector<journal_record> pending;
+
+    /**
+     * Configure from env, and expand (or survey, in lazy mode) the
+     * configurations, unless build is false, in which case only the options
+     * and matrix are set up, e.g. for count(). With a strength, only a
+     * covering array of that strength is generated (see cover()). The blur
+     * is keyed by seed, so the same env and seed give the same instance.
+     * Building uses threads_in threads (all cores if 0).
+     */
+    wc(we::we& env, uint32_t flags = 0, bool build = true, size_t strength_in = 0, uint64_t seed_in = time(NULL), size_t threads_in = 0);
+
+    /**
+     * Configure from env, which is an edited version of the specification
+     * of previous, and build an instance which carries its progress over:
+     * its mode and seed, the inclusions and penalties of settings which are
+     * still there, and the emitted configurations which still exist. Only
+     * the configurations with settings which are new or have new
+     * requirements are expanded; the rest are taken from previous. A
+     * covering array cannot be carried over: which combinations its emitted
+     * configurations covered is not kept, so there is no telling which ones
+     * the new instance would still have to cover.
+     */
+    wc(we::we& env, const wc& previous, size_t threads_in = 0);
+
+    /**
+     * Load an instance from fp. With in_place, a v2 file is mapped instead
+     * (fp must then be open for reading and writing), and store() writes
+     * any changes back to it.
+     */
+    wc(FILE* fp, bool in_place = false);
+
+    ~wc();
+
+    /**
+     * Generate the configurations of a freshly configured instance (see the
+     * constructors), reusing those of from->previous if given.
+     */
+    void build(size_t strength, const lineage* from = nullptr);
+
+    /**
+     * Generate every acceptable configuration. With from, only those with a
+     * setting which is new or has new requirements are enumerated; the rest
+     * are the rows of from->previous which have not been emitted.
+     */
+    void expand(const lineage* from = nullptr);
+
+    /**
+     * Append every acceptable configuration to t, in id order.
+     */
+    void enumerate(table& t) const;
+
+    /**
+     * Generate a covering array of the given strength t instead of every
+     * configuration: acceptable configurations such that every combination
+     * of t settings (of t different options) which any acceptable
+     * configuration contains is contained in at least one of them. Built
+     * one option at a time (IPOG), so the number of rows grows with the
+     * logarithm of the number of options rather than with the product of
+     * their sizes. Requires the matrix.
+     */
+    void cover(size_t strength);
+
+    /**
+     * Count the occurrences of each setting in the table, and drop what was
+     * only needed to build it.
+     */
+    void tally();
+
+    /**
+     * Fill in the free cells (free_cell) of a partial configuration so that
+     * it becomes acceptable. Returns false if the cells already set rule
+     * that out. Requires the matrix.
+     */
+    bool complete(sidx_t* row) const;
+
+    void survey();
+
+    void decompose(const lineage* from = nullptr);
+
+    /**
+     * Count the acceptable configurations without enumerating them, optionally
+     * only those where option fixed_option has setting fixed_setting.
+     * Requires the matrix.
+     *
+     * Options are added one at a time, keeping a count for every combination
+     * of settings of those earlier options which still have requirements in
+     * common with a later one (the frontier). This takes time proportional to
+     * the number of such combinations rather than to the number of
+     * configurations, so it is fast as long as options mostly depend on
+     * options declared near them.
+     */
+    census count(size_t fixed_option = SIZE_MAX, size_t fixed_setting = 0) const;
+
+    size_t remaining_rows() const;
+
+    size_t remaining() const;
+
+    void save_schema(FILE* fp) const;
+
+    void load_schema(FILE* fp);
+
+    void save_state(FILE* fp) const;
+
+    bool load_state(FILE* fp);
+
+    void save(FILE* fp) const;
 
-    void replace_config(std::vector<configuration*>* new_config);
+    void load(FILE* fp);
 
-    wc(we::we& env);
+    void load_v1(FILE* fp);
 
-    wc(FILE* fp);
+    void check_header(const scd_header& h) const;
 
-    void save(FILE* fp) const;
+    std::vector<char> tail() const;
 
-    void load(FILE* fp);
+    void replay(const journal_record& rec);
 
-    bool emit_and_penalize(FILE* stream);
+    void replay_journal(const std::vector<char>& records, uint64_t offset);
 
-    void sort();
+    bool map(FILE* fp);
+
+    void write_back(int fd, const std::vector<char>& extents, uint64_t size);
+
+    /**
+     * Write the instance back to the file it was loaded from: in place if it
+     * is mapped, as journal records if it is journaled, or as a new v2 file
+     * otherwise. Other than journal records, which are appended, everything
+     * goes through a write-back (see writeback_trailer).
+     */
+    void store(FILE* fp);
+
+    /**
+     * Whether replaying the journal has become more work than writing a new
+     * snapshot would be.
+     */
+    bool needs_compaction() const;
+
+    /**
+     * Fold the journal into a new snapshot of the instance, and replace the
+     * file at path with it.
+     */
+    void compact(const char* path);
+
+    /**
+     * Remove the next configuration from the schedule, copying it into row,
+     * and penalize the rest. Returns false if there is nothing left.
+     */
+    bool take(sidx_t* row);
+
+    void settle(size_t r, const sidx_t* row);
+
+    void retire(size_t r, const sidx_t* row);
+
+    bool emit_and_penalize(FILE* stream);
 
     void blur();
 
     void normalize();
 
+    inline setting* si(const sidx_t* row, size_t i) const { return options[i]->settings[row[i]]; }
+
+    /**
+     * Call visit(row) for every acceptable configuration, in id order. Rows
+     * are decoded digit by digit, and a digit which fails the requirements
+     * skips every configuration sharing that prefix. Requires the matrix.
+     */
+    template<typename F> void walk(F visit) const {
+        std::vector<size_t> all(options.size());
+        for (size_t k = 0; k < all.size(); ++k) all[k] = k;
+        walk(all, visit);
+    }
+
+    /**
+     * Same as walk(visit), but for the options in opts only: rows have one
+     * setting index per entry of opts. With a prefix, only the rows beginning
+     * with its first fixed entries are visited (the prefix must itself be
+     * acceptable).
+     */
+    template<typename F> void walk(const std::vector<size_t>& opts, F visit, const sidx_t* prefix = nullptr, size_t fixed = 0) const {
+        size_t n = opts.size();
+        if (n == 0) return;
+        size_t words = matrix.words;
+        // allowed[k] holds the settings compatible with row[0..k-1]
+        std::vector<uint64_t> allowed((n + 1) * words);
+        std::copy(matrix.alive.begin(), matrix.alive.end(), allowed.begin());
+        std::vector<sidx_t> row(n);
+        for (size_t k = 0; k < fixed; ++k) {
+            row[k] = prefix[k];
+            matrix.narrow(&allowed[(k + 1) * words], &allowed[k * words], matrix.base[opts[k]] + prefix[k]);
+        }
+        if (fixed == n) {
+            visit(row.data());
+            return;
+        }
+        std::vector<size_t> next(n, 0);
+        size_t k = fixed;
+        for (;;) {
+            if (next[k] == options[opts[k]]->settings.size()) {
+                if (k == fixed) break;
+                --k;
+                continue;
+            }
+            size_t i = next[k]++;
+            size_t g = matrix.base[opts[k]] + i;
+            if (!compat_matrix::test(&allowed[k * words], g)) continue;
+            row[k] = i;
+            if (k + 1 == n) {
+                visit(row.data());
+            } else {
+                matrix.narrow(&allowed[(k + 1) * words], &allowed[k * words], g);
+                next[++k] = 0;
+            }
+        }
+    }
+
+    cid_t id_of(const sidx_t* row) const;
+
+    void decode(cid_t id, sidx_t* row) const;
+
+    float accumulated_penalty(const sidx_t* row) const;
+
+    float accumulated_last_penalty(const sidx_t* row) const;
+
+    float penalty_floor() const;
+
+    float lazy_pri(const sidx_t* row) const;
+
+    bool find_lazy(sidx_t* best) const;
+
+    bool find_accumulated(size_t& best) const;
+
+    bool find_composite(sidx_t* best) const;
+
+    /**
+     * The remaining configurations with their current priorities, in
+     * ascending order of priority, or only the top ones of them. Only the
+     * top rows are ever sorted.
+     */
+    table snapshot(size_t top = SIZE_MAX) const;
+
+    void will_emit(const sidx_t* row);
+
+    float calc_pri(const sidx_t* row) const;
+
+    /**
+     * Penalize every row of the table for the settings it has in common with
+     * basis, whose penalties will_emit() has just worked out.
+     */
+    void penalize(const sidx_t* basis);
+
+    void emit_row(const sidx_t* row, FILE* fp) const;
+
+    std::string to_string(const sidx_t* row) const;
+
     virtual void emit(const std::string& output) override;
 
     virtual void branch(const std::string& desc, const std::string& var, const std::string& val, const std::string& emits, int priority, std::vector<we::restricter*> conditions) override;
@@ -19,6 +19,7 @@ struct configurator {
 };
 
 struct node {
+    virtual ~node() {}
     virtual std::string to_string() const {
         return "<node>";
     }
@@ -133,6 +134,11 @@ struct we: public tiny::st_callback_table {
     ~we() {
         for (auto& e : restricters) delete e;
         for (auto& n : nodes) delete n;
+        while (e) {
+            env* parent = e->parent;
+            delete e;
+            e = parent;
+        }
     }
 
     virtual void emit(const std::string& output) override {
@@ -2,6 +2,16 @@
 #include <compiler/tinyparser.h>
 #include <we.h>
 #include <wc.h>
+#include <cliargs.h>
+
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 std::string derive_output(const std::string& str) {
     auto i = str.rfind('.', str.length());
@@ -13,51 +23,321 @@ std::string derive_output(const std::string& str) {
     return str + ".scd";
 }
 
-int main(int argc, const char* argv[])
+bool is_spec(const std::string& str) {
+    return str.length() > 4 && str.compare(str.length() - 4, 4, ".wpc") == 0;
+}
+
+std::string human_size(double bytes) {
+    const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB", "EiB"};
+    size_t u = 0;
+    while (bytes >= 1024 && u < 6) { bytes /= 1024; ++u; }
+    return bytes >= 1024 ? strprintf("%.3g %s", bytes, units[u]) : strprintf("%.1f %s", bytes, units[u]);
+}
+
+/**
+ * Specification text: the file mapped into memory where possible, or read
+ * in full from stdin (path "-") or anything else which cannot be mapped,
+ * such as a pipe.
+ */
+struct spec_source {
+    const char* data = nullptr;
+    size_t size = 0;
+    void* mapped = nullptr;
+    std::vector<char> buf;
+
+    ~spec_source() { if (mapped) munmap(mapped, size); }
+
+    void read_all(int fd) {
+        size_t len = 0;
+        buf.resize(65536);
+        for (ssize_t n; (n = read(fd, buf.data() + len, buf.size() - len)) != 0; ) {
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error(strprintf("read failed: %s", strerror(errno)));
+            }
+            len += n;
+            if (len == buf.size()) buf.resize(2 * len);
+        }
+        data = buf.data();
+        size = len;
+    }
+
+    bool open(const char* path) {
+        if (!strcmp(path, "-")) {
+            read_all(STDIN_FILENO);
+            return true;
+        }
+        int fd = ::open(path, O_RDONLY);
+        struct stat st;
+        if (fd < 0) return false;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                madvise(p, st.st_size, MADV_SEQUENTIAL);
+                mapped = p;
+                data = (const char*)p;
+                size = st.st_size;
+                close(fd);
+                return true;
+            }
+        }
+        read_all(fd);
+        close(fd);
+        return true;
+    }
+};
+
+/**
+ * What to do with each specification.
+ */
+struct job {
+    uint32_t flags = 0;
+    size_t strength = 0;
+    uint64_t seed = 0;
+    bool count = false, estimate = false;
+    size_t threads = 0; // threads for each compilation (all cores if 0)
+    std::string update; // instance to carry progress over from, if any
+};
+
+/**
+ * Compile the specification at spec into output, or count it, and return
+ * what wpc prints for it. All of the state of the compilation is local to
+ * this call, so several can run at once. Throws on failure.
+ */
+std::string compile(const char* spec, const std::string& output, const job& j) {
+    spec_source src;
+    if (!src.open(spec)) throw std::runtime_error(strprintf("File not found or not readable: %s", spec));
+    std::vector<tiny::token_t> tokens = tiny::tokenize(src.data, src.size);
+    tiny::token_t* t = tokens[0].token == tiny::tok_undef ? nullptr : &tokens[0];
+    we::we we;
+    {
+        // the syntax tree is only needed until it has been run; we copies what
+        // it keeps, so the nodes all go at once when the context does
+        tiny::context ctx;
+        while (t) {
+            auto p = tiny::treeify(&t, ctx, true);
+            if (!p) throw std::runtime_error(strprintf("parse failed around line %zu, col %zu", t->line, t->col));
+            // printf("We got sumfin:\n");
+            // p->print();
+            // printf("\n");
+            p->exec(&we);
+            // printf("Result:\n");
+            // we.print();
+        }
+    }
+
+    std::string out;
+    if (j.count || j.estimate) {
+        wc::wc wc(we, j.flags, false, 0, j.seed, j.threads);
+        wc::census c = wc.count();
+        out += strprintf("%s\n", c.total.to_string());
+        if (j.count) {
+            for (size_t k = 0; k < wc.options.size(); ++k) {
+                const wc::option* o = wc.options[k];
+                for (size_t i = 0; i < o->settings.size(); ++i) {
+                    out += strprintf("%s=%s %s\n", o->name, o->settings[i]->value, wc.count(k, i).total.to_string());
+                }
+            }
+        }
+        if (j.estimate) {
+            size_t width = wc.options.size();
+            size_t row_bytes = wc::table::block_size(width, 1);
+            size_t state_bytes = sizeof(wc::scd_header) + wc.tail().size();
+            wc::bigcount table_bytes = c.total * row_bytes;
+            wc::bigcount scd_bytes = table_bytes;
+            scd_bytes += wc::bigcount(state_bytes);
+            out += strprintf("table:    %s bytes (%s), %zu bytes per configuration\n", table_bytes.to_string(), human_size(table_bytes.to_double()), row_bytes);
+            out += strprintf("instance: %s bytes (%s)\n", scd_bytes.to_string(), human_size(scd_bytes.to_double()));
+            out += strprintf("lazy:     %zu bytes, plus %zu per emitted configuration\n", state_bytes, sizeof(wc::cid_t));
+        }
+        return out;
+    }
+    if (j.update.size()) {
+        FILE* fold = fopen(j.update.c_str(), "rb");
+        if (!fold) throw std::runtime_error(strprintf("Unable to open file: %s", j.update));
+        std::unique_ptr<wc::wc> previous;
+        try {
+            previous.reset(new wc::wc(fold));
+        } catch (...) {
+            fclose(fold);
+            throw;
+        }
+        fclose(fold);
+        wc::wc wc(we, *previous, j.threads);
+        previous.reset();
+        // the output is often the instance we started from, so it is only
+        // replaced once the new one has been written in full
+        wc.compact(output.c_str());
+        return strprintf("%zu\n", wc.remaining());
+    }
+    wc::wc wc(we, j.flags, true, j.strength, j.seed, j.threads);
+
+    FILE* fres = fopen(output.c_str(), "wb");
+    if (!fres) throw std::runtime_error(strprintf("Unable to open file: %s", output));
+    wc.save(fres);
+    fclose(fres);
+    return strprintf("%zu\n", wc.remaining());
+}
+
+int main(int argc, char* const* argv)
 {
-    if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Syntax: %s <specification> [<output>]\n", argv[0]);
-        fprintf(stderr, "Output is derived from <specification> if left out.\n");
+    cliargs ca;
+    ca.add_option("help", 'h', no_arg);
+    ca.add_option("lazy", 'L', no_arg);
+    ca.add_option("accumulate", 'A', no_arg);
+    ca.add_option("journal", 'J', no_arg);
+    ca.add_option("decompose", 'G', no_arg);
+    ca.add_option("strength", 't', req_arg);
+    ca.add_option("count", 'c', no_arg);
+    ca.add_option("estimate", 'e', no_arg);
+    ca.add_option("seed", 's', req_arg);
+    ca.add_option("jobs", 'j', req_arg);
+    ca.add_option("update", 'u', req_arg);
+    ca.parse(argc, argv);
+    // more than two arguments are all specifications, as is a second one
+    // which looks like one, rather than the output to write
+    bool several = ca.l.size() > 2 || (ca.l.size() == 2 && is_spec(ca.l[1]));
+    if (ca.m.count('h') || ca.l.size() < 1) {
+        fprintf(stderr, "Syntax: %s [options] <specification> [<output>]\n", argv[0]);
+        fprintf(stderr, "        %s [options] <specification> <specification> [...]\n", argv[0]);
+        fprintf(stderr, "Output is derived from <specification> if left out, and always when there are\n");
+        fprintf(stderr, "several specifications (more than two, or the second ending in .wpc).\n");
+        fprintf(stderr, "Use - as <specification> to read it from stdin (<output> is then required).\n");
+        fprintf(stderr, "Available options:\n"
+            "    --help       | -h   Show this help text\n"
+            "    --lazy       | -L   Enumerate configurations on demand instead of storing them\n"
+            "    --accumulate | -A   Derive penalties from per-setting totals instead of\n"
+            "                        penalizing every configuration on each emission\n"
+            "    --journal    | -J   Append emissions to a journal instead of updating the\n"
+            "                        instance (best combined with -A or -L)\n"
+            "    --decompose  | -G   Store groups of options which have no requirements in\n"
+            "                        common separately, and combine them on demand (penalties\n"
+            "                        are derived as with -A)\n"
+            "    --strength   | -t   Only generate enough configurations to cover every\n"
+            "                        combination of <t> settings (e.g. 2 for pairwise)\n"
+            "    --count      | -c   Count the configurations and the occurrences of each\n"
+            "                        setting, without generating anything\n"
+            "    --estimate   | -e   Count the configurations and show how much memory and\n"
+            "                        disk generating them would take\n"
+            "    --seed       | -s   Seed for the blur (default: the current time); the same\n"
+            "                        specification and seed give the same instance\n"
+            "    --jobs       | -j   Threads to use in all (default all cores); several\n"
+            "                        specifications are compiled side by side\n"
+            "    --update     | -u   Carry the progress of the instance <u>, compiled from an\n"
+            "                        earlier version of the specification, over to the new\n"
+            "                        instance (which keeps the mode and seed of <u>)\n"
+        );
         exit(1);
     }
-    const char* spec = argv[1];
-    std::string output_string = argc == 3 ? argv[2] : derive_output(spec);
-    const char* output = output_string.c_str();
-    FILE* fp = fopen(spec, "r");
-    if (!fp) {
-        fprintf(stderr, "File not found or not readable: %s\n", spec);
-        exit(1);
+    job j;
+    if (ca.m.count('L')) j.flags |= wc::state_lazy;
+    if (ca.m.count('A')) j.flags |= wc::state_accumulate;
+    if (ca.m.count('J')) j.flags |= wc::state_journal;
+    if (ca.m.count('G')) {
+        if (ca.m.count('L')) {
+            fprintf(stderr, "--decompose cannot be combined with --lazy\n");
+            exit(1);
+        }
+        j.flags = (j.flags & ~wc::state_accumulate) | wc::state_decompose;
+    }
+    if (ca.m.count('t')) {
+        char* end;
+        j.strength = strtoul(ca.m['t'].c_str(), &end, 10);
+        if (*end || j.strength == 0) {
+            fprintf(stderr, "Invalid strength: %s\n", ca.m['t'].c_str());
+            exit(1);
+        }
+        if (j.flags & (wc::state_lazy | wc::state_decompose)) {
+            fprintf(stderr, "--strength cannot be combined with --lazy or --decompose\n");
+            exit(1);
+        }
     }
-    char buf[1024];
-    std::string s;
-    while (fgets(buf, 1024, fp)) {
-        s += buf;
+    j.seed = time(NULL);
+    if (ca.m.count('s')) {
+        char* end;
+        j.seed = strtoull(ca.m['s'].c_str(), &end, 10);
+        if (*end || ca.m['s'].empty()) {
+            fprintf(stderr, "Invalid seed: %s\n", ca.m['s'].c_str());
+            exit(1);
+        }
     }
-    fclose(fp);
-    auto t = tiny::tokenize(s.c_str());
-    we::we we;
-    while (t) {
-        auto p = tiny::treeify(&t, true);
-        if (!p) {
-            fprintf(stderr, "parse failed around line %zu, col %zu\n", t->line, t->col);
+    j.count = ca.m.count('c');
+    j.estimate = ca.m.count('e');
+    size_t jobs = 0;
+    if (ca.m.count('j')) {
+        char* end;
+        jobs = strtoul(ca.m['j'].c_str(), &end, 10);
+        if (*end || jobs == 0) {
+            fprintf(stderr, "Invalid thread count: %s\n", ca.m['j'].c_str());
+            exit(1);
+        }
+    }
+
+    if (ca.m.count('u')) {
+        if (several) {
+            fprintf(stderr, "--update takes a single specification\n");
             exit(1);
         }
-        // printf("We got sumfin:\n");
-        // p->print();
-        // printf("\n");
-        p->exec(&we);
-        // printf("Result:\n");
-        // we.print();
+        for (char c : std::string("LAJGtsce")) {
+            if (ca.m.count(c)) {
+                fprintf(stderr, "--update cannot be combined with -%c (the instance keeps its mode and seed)\n", c);
+                exit(1);
+            }
+        }
+        j.update = ca.m['u'];
     }
 
-    wc::wc wc(we);
+    std::vector<std::string> specs, outputs;
+    for (size_t i = 0; i < (several ? ca.l.size() : 1); ++i) {
+        specs.push_back(ca.l[i]);
+        outputs.push_back(!several && ca.l.size() == 2 ? ca.l[1] : derive_output(ca.l[i]));
+        if (specs.back() == "-" && (several || ca.l.size() < 2)) {
+            fprintf(stderr, "An output file is required when reading the specification from stdin\n");
+            exit(1);
+        }
+    }
+    if (!several) {
+        j.threads = jobs;
+        try {
+            fputs(compile(specs[0].c_str(), outputs[0], j).c_str(), stdout);
+        } catch (const std::exception& e) {
+            fprintf(stderr, "%s\n", e.what());
+            exit(1);
+        }
+        return 0;
+    }
 
-    FILE* fres = fopen(output, "wb");
-    if (!fres) {
-        fprintf(stderr, "Unable to open file: %s\n", output);
-        exit(1);
+    // the specifications are handed out to workers in turn, and the threads
+    // not needed for that go to the compilations themselves
+    size_t workers = std::min(jobs ? jobs : 1, specs.size());
+    if (jobs) j.threads = std::max<size_t>(1, jobs / workers);
+    std::vector<std::string> results(specs.size()), errors(specs.size());
+    std::atomic<size_t> next(0);
+    auto run = [&]() {
+        for (size_t i; (i = next++) < specs.size(); ) {
+            try {
+                results[i] = compile(specs[i].c_str(), outputs[i], j);
+            } catch (const std::exception& e) {
+                errors[i] = e.what();
+            }
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < workers; ++t) pool.emplace_back(run);
+    run();
+    for (std::thread& t : pool) t.join();
+    int status = 0;
+    for (size_t i = 0; i < specs.size(); ++i) {
+        if (errors[i].size()) {
+            fprintf(stderr, "%s: %s\n", specs[i].c_str(), errors[i].c_str());
+            status = 1;
+            continue;
+        }
+        // each line of output is marked with the specification it is for
+        for (size_t p = 0, q; p < results[i].size(); p = q + 1) {
+            q = results[i].find('\n', p);
+            printf("%s: %s\n", specs[i].c_str(), results[i].substr(p, q - p).c_str());
+        }
     }
-    wc.save(fres);
-    fclose(fres);
-    printf("%zu\n", wc.configurations->size());
+    return status;
 }
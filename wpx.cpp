@@ -2,6 +2,19 @@
 #include <cliargs.h>
 #include <sb.h>
 
+#include <cerrno>
+#include <csignal>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
 inline std::string c(const std::string& v, size_t w) {
     char buf[256];
     size_t vlen = v.length();
@@ -14,73 +27,560 @@ inline std::string c(const std::string& v, size_t w) {
     return r ? strprintf(fmt, v, "") : strprintf(fmt, v);
 }
 
+void print_list(const wc::wc& wc, FILE* out, size_t top = SIZE_MAX) {
+    fprintf(out, " #  |    PRI   |    PEN   | CONFIG\n");
+    wc::table t = wc.snapshot(top);
+    size_t idx = t.size();
+    for (size_t r = 0; r < t.size(); ++r) { idx--; fprintf(out, "%3zu | %8.5f | %8.5f | %s\n", idx, t.pri[r], t.last_penalty[r], wc.to_string(t.row(r)).c_str()); }
+}
+
+void print_stats(const wc::wc& wc, FILE* out) {
+    sb fmt, res, occ, inc, pri;
+    fmt += ' '; res += ' '; occ += ' '; inc += ' '; pri += ' ';
+    fprintf(out, " ");
+    for (auto& o : wc.options) {
+        size_t minwidth = 1 + o->name.length();
+        size_t optlen = 0;
+        for (auto& s : o->settings) {
+            size_t slen = std::max<size_t>({3, s->value.length(), std::to_string(s->inclusions).length(), std::to_string(s->occurrences).length()});
+            std::string f = "%-" + std::to_string(slen) + "s ";
+            fmt += strprintf(f, s->value);
+            f = "%-" + std::to_string(slen) + "zu ";
+            optlen += slen + 1;
+            size_t r = s->occurrences ? (100 * s->inclusions) / s->occurrences : 100;
+            res += strprintf(f, r);
+            occ += strprintf(f, s->occurrences);
+            inc += strprintf(f, s->inclusions);
+            f = "%-" + std::to_string(slen) + "d ";
+            pri += strprintf(f, s->priority);
+        }
+        if (minwidth > optlen) {
+            std::string f = "%" + std::to_string(minwidth - optlen) + "s";
+            fmt += strprintf(f, "");
+            res += strprintf(f, "");
+            occ += strprintf(f, "");
+            inc += strprintf(f, "");
+            pri += strprintf(f, "");
+        }
+        minwidth = std::max(minwidth, optlen);
+        fputs((c(o->name, minwidth) + " ").c_str(), out);
+        fmt += ' '; res += ' '; occ += ' '; inc += ' '; pri += ' ';
+    }
+    fprintf(out, "\n%s\n%s (%%)\n%s (priority)\n%s (count)\n%s (total)\n", fmt.c_str(), res.c_str(), pri.c_str(), inc.c_str(), occ.c_str());
+}
+
+void print_report(const wc::wc& wc, FILE* out) {
+    size_t remaining = wc.remaining();
+    fprintf(out, "%zu of %zu configurations emitted, %zu remaining\n", wc.total_combinations - remaining, wc.total_combinations, remaining);
+}
+
+typedef std::function<bool(wc::sidx_t*)> row_source;
+
+/**
+ * Take up to count configurations from next (wc.take() by default) and write
+ * them to out, separated by separator lines, or to <outdir>/<i>.rc if outdir
+ * is set. Returns the number of configurations taken. If an output file
+ * cannot be opened, *failed is set and nothing more is taken, so what was
+ * taken before still needs to be stored.
+ */
+size_t emit_batch(wc::wc& wc, size_t count, const std::string& separator, const char* outdir, FILE* out, row_source next = nullptr, bool* failed = nullptr) {
+    // emitting n configurations in one go gives the same order as n
+    // separate calls, but only loads and saves the instance once
+    if (!next) next = [&](wc::sidx_t* row) { return wc.take(row); };
+    std::vector<wc::sidx_t> row(wc.options.size());
+    size_t emitted;
+    for (emitted = 0; emitted < count; ++emitted) {
+        // the file is opened before the configuration is taken, so none is
+        // ever taken without somewhere to go
+        FILE* dst = out;
+        std::string path;
+        if (outdir) {
+            path = strprintf("%s/%zu.rc", outdir, emitted);
+            dst = fopen(path.c_str(), "w");
+            if (!dst) {
+                fprintf(stderr, "Unable to open file: %s\n", path.c_str());
+                if (failed) *failed = true;
+                break;
+            }
+        }
+        if (!next(row.data())) {
+            if (dst != out) {
+                fclose(dst);
+                unlink(path.c_str());
+            }
+            break;
+        }
+        if (!outdir && emitted) fprintf(out, "%s\n", separator.c_str());
+        fputs(wc.emits.c_str(), dst);
+        wc.emit_row(row.data(), dst);
+        if (dst != out) fclose(dst);
+    }
+    return emitted;
+}
+
+/**
+ * Advisory lock on an instance, held for as long as the object lives. It is
+ * taken on <path>.lock, which unlike the instance itself is never replaced
+ * (see wc::compact()). Anything which changes the instance holds it
+ * exclusively and readers hold it shared, so concurrent calls on the same
+ * instance, also from other hosts on a shared filesystem with fcntl locking,
+ * take turns instead of overwriting each other's changes.
+ */
+struct instance_lock {
+    int fd;
+    instance_lock(const char* path, bool exclusive, bool wait = true) {
+        std::string lock_path = strprintf("%s.lock", path);
+        // a reader only needs to read the lock file, and where it cannot be
+        // opened or created (e.g. a directory we may not write to), reads
+        // without one, as nothing can change the instance there either
+        fd = exclusive ? -1 : open(lock_path.c_str(), O_RDONLY);
+        if (fd < 0) fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd < 0 && !exclusive) return;
+        if (fd < 0) {
+            fprintf(stderr, "Unable to open lock file %s: %s\n", lock_path.c_str(), strerror(errno));
+            exit(1);
+        }
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = exclusive ? F_WRLCK : F_RDLCK;
+        fl.l_whence = SEEK_SET;
+        while (fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl)) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Unable to lock %s: %s\n", path, strerror(errno));
+            exit(1);
+        }
+    }
+    ~instance_lock() { if (fd >= 0) close(fd); }
+};
+
+/**
+ * Leases on configurations handed out with --lease, kept in <path>.leases as
+ * "<id> <expiry> <worker>" lines. A lease ends when its worker reports back
+ * with --done; if it expires first, the configuration is handed out again,
+ * before anything new, to whoever asks next. Only read or written under an
+ * exclusive instance_lock.
+ */
+struct lease {
+    wc::cid_t id;
+    time_t expires;
+    std::string worker;
+};
+
+std::vector<lease> load_leases(const char* path) {
+    std::vector<lease> leases;
+    FILE* fp = fopen(strprintf("%s.leases", path).c_str(), "r");
+    if (!fp) return leases;
+    unsigned long long id;
+    long long expires;
+    char worker[256];
+    while (fscanf(fp, "%llu %lld %255s", &id, &expires, worker) == 3) leases.push_back({(wc::cid_t)id, (time_t)expires, worker});
+    fclose(fp);
+    return leases;
+}
+
+void save_leases(const char* path, const std::vector<lease>& leases) {
+    std::string lease_path = strprintf("%s.leases", path);
+    if (leases.empty()) {
+        unlink(lease_path.c_str());
+        return;
+    }
+    std::string tmp = lease_path + ".tmp";
+    FILE* fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Unable to open file: %s\n", tmp.c_str());
+        exit(1);
+    }
+    for (const lease& l : leases) fprintf(fp, "%llu %lld %s\n", (unsigned long long)l.id, (long long)l.expires, l.worker.c_str());
+    if (fflush(fp) || fsync(fileno(fp)) || fclose(fp) || rename(tmp.c_str(), lease_path.c_str())) {
+        fprintf(stderr, "Unable to write leases to %s: %s\n", lease_path.c_str(), strerror(errno));
+        exit(1);
+    }
+}
+
+/**
+ * Scheduler server.
+ * Keeps one instance loaded and answers requests on a Unix domain socket, one
+ * per connection. A request is a single line:
+ *
+ *     next <n> <separator>   emit up to n configurations
+ *     list [<k>]             same as wpx -l [--top k]
+ *     stats                  same as wpx -s
+ *     report                 same as wpx -r
+ *
+ * The reply is a status line (ok, empty if there was nothing left to emit,
+ * or error <message>), followed by the same output wpx would have printed.
+ * Changes are written back to the instance every interval seconds, and on
+ * SIGINT or SIGTERM.
+ */
+struct server {
+    const char* path;
+    std::unique_ptr<wc::wc> wc;
+    bool dirty = false;
+
+    server(const char* path_in, size_t threads) : path(path_in) {
+        // the instance is loaded rather than mapped, so nothing reaches the
+        // file between snapshots, and each snapshot replaces the file in one
+        // rename (see wc::compact()); killing the server loses what it has
+        // emitted since the last one, but never leaves the file half written
+        FILE* fp = fopen(path, "rb");
+        if (!fp) throw std::runtime_error(strprintf("file not found or not readable: %s", path));
+        wc.reset(new wc::wc(fp));
+        fclose(fp);
+        wc->threads = threads;
+    }
+
+    void snapshot() {
+        if (!dirty) return;
+        wc->compact(path);
+        dirty = false;
+    }
+
+    void handle(const std::string& request, FILE* out) {
+        std::string command = request.substr(0, request.find(' '));
+        if (command == "next") {
+            char* end;
+            size_t count = strtoul(request.c_str() + 4, &end, 10);
+            std::string separator = *end == ' ' ? end + 1 : "---";
+            if (count == 0) count = 1;
+            // the status goes first, so the batch is written to a buffer
+            char* buf;
+            size_t len;
+            FILE* ms = open_memstream(&buf, &len);
+            size_t emitted = emit_batch(*wc, count, separator, nullptr, ms);
+            fclose(ms);
+            if (emitted) dirty = true;
+            fprintf(out, "%s\n", emitted ? "ok" : "empty");
+            fwrite(buf, 1, len, out);
+            free(buf);
+        } else if (command == "list") {
+            size_t top = request.size() > 5 ? strtoul(request.c_str() + 5, nullptr, 10) : 0;
+            fprintf(out, "ok\n");
+            print_list(*wc, out, top ? top : SIZE_MAX);
+        } else if (command == "stats") {
+            fprintf(out, "ok\n");
+            print_stats(*wc, out);
+        } else if (command == "report") {
+            fprintf(out, "ok\n");
+            print_report(*wc, out);
+        } else {
+            fprintf(out, "error unknown request: %s\n", command.c_str());
+        }
+    }
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+void stop(int) { stopping = 1; }
+
+int listen_on(const char* socket_path) {
+    struct sockaddr_un addr;
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path too long: %s\n", socket_path);
+        exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16)) {
+        fprintf(stderr, "Unable to listen on %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+int connect_to(const char* socket_path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        fprintf(stderr, "Unable to connect to %s: %s\n", socket_path, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+static const int request_timeout = 5; // seconds
+
+/**
+ * Read a request line (without the newline) from a client into request.
+ * Returns false if the client does not send a complete line of up to 4096
+ * bytes within request_timeout seconds.
+ */
+bool read_request(int cfd, std::string& request) {
+    time_t deadline = time(nullptr) + request_timeout;
+    char ch;
+    while (request.size() < 4096) {
+        struct pollfd pfd = {cfd, POLLIN, 0};
+        int left = deadline - time(nullptr);
+        if (left <= 0 || poll(&pfd, 1, left * 1000) <= 0) return false;
+        if (read(cfd, &ch, 1) != 1) return false;
+        if (ch == '\n') return true;
+        request += ch;
+    }
+    return false;
+}
+
+void serve(const char* path, const char* socket_path, unsigned interval, size_t threads) {
+    // the instance is ours for as long as we serve it
+    instance_lock lock(path, true, false);
+    server srv(path, threads);
+    int lfd = listen_on(socket_path);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop; // no SA_RESTART, so poll() is interrupted
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+    time_t last = time(nullptr);
+    while (!stopping) {
+        time_t now = time(nullptr);
+        if (now - last >= interval) {
+            // a failed snapshot is tried again at the next interval
+            try {
+                srv.snapshot();
+            } catch (const std::exception& e) {
+                fprintf(stderr, "%s\n", e.what());
+            }
+            last = now;
+        }
+        struct pollfd pfd = {lfd, POLLIN, 0};
+        int timeout = std::max<int>(0, interval - (now - last)) * 1000;
+        if (poll(&pfd, 1, timeout) <= 0) continue;
+        int cfd = accept(lfd, nullptr, nullptr);
+        if (cfd < 0) continue;
+        // everyone else waits while we serve one client, so a client gets
+        // request_timeout seconds to send its line and take the reply, and
+        // is dropped if it does not
+        struct timeval tv = {request_timeout, 0};
+        setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        std::string request;
+        if (!read_request(cfd, request)) {
+            close(cfd);
+            continue;
+        }
+        FILE* out = fdopen(cfd, "w");
+        try {
+            srv.handle(request, out);
+        } catch (const std::exception& e) {
+            fprintf(out, "error %s\n", e.what());
+        }
+        fclose(out);
+    }
+    srv.snapshot();
+    close(lfd);
+    unlink(socket_path);
+}
+
+int request(const char* socket_path, const std::string& request) {
+    int fd = connect_to(socket_path);
+    std::string line = request + "\n";
+    if (write(fd, line.c_str(), line.size()) != (ssize_t)line.size()) {
+        fprintf(stderr, "Unable to send request: %s\n", strerror(errno));
+        exit(1);
+    }
+    FILE* in = fdopen(fd, "r");
+    char buf[4096];
+    if (!fgets(buf, sizeof(buf), in)) {
+        fprintf(stderr, "No reply from %s\n", socket_path);
+        exit(1);
+    }
+    std::string status = buf;
+    if (status.compare(0, 6, "error ") == 0) {
+        fprintf(stderr, "%s", status.c_str() + 6);
+        exit(1);
+    }
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, stdout);
+    fclose(in);
+    return status == "ok\n" ? 0 : 1;
+}
+
 int main(int argc, char* const* argv)
 {
     cliargs ca;
     ca.add_option("help", 'h', no_arg);
     ca.add_option("list", 'l', no_arg);
     ca.add_option("stats", 's', no_arg);
+    ca.add_option("report", 'r', no_arg);
+    ca.add_option("count", 'n', req_arg);
+    ca.add_option("separator", 'S', req_arg);
+    ca.add_option("outdir", 'o', req_arg);
+    ca.add_option("compact", 'C', no_arg);
+    ca.add_option("serve", 'D', req_arg);
+    ca.add_option("interval", 'i', req_arg);
+    ca.add_option("connect", 'c', req_arg);
+    ca.add_option("lease", 't', req_arg);
+    ca.add_option("worker", 'w', req_arg);
+    ca.add_option("done", 'd', no_arg);
+    ca.add_option("jobs", 'j', req_arg);
+    ca.add_option("top", 'k', req_arg);
     ca.parse(argc, argv);
-    if (ca.m.count('h') || ca.l.size() == 0) {
+    if (ca.m.count('h') || (ca.l.size() == 0 && !ca.m.count('c'))) {
         fprintf(stderr, "Syntax: %s [options] <configuration>\n", argv[0]);
+        fprintf(stderr, "        %s --connect <socket> [options]\n", argv[0]);
         fprintf(stderr, "Available options:\n"
-            "    --help  | -h   Show this help text\n"
-            "    --list  | -l   List the contents of the given configuration\n"
-            "    --stats | -s   Show statistics about coverage\n"
+            "    --help      | -h         Show this help text\n"
+            "    --list      | -l         List the contents of the given configuration\n"
+            "    --top       | -k <k>     Only list the k configurations of highest priority\n"
+            "    --stats     | -s         Show statistics about coverage\n"
+            "    --report    | -r         Show how many configurations have been emitted\n"
+            "    --count     | -n <n>     Emit up to n configurations at once (default 1)\n"
+            "    --separator | -S <line>  Line to print between configurations (default ---)\n"
+            "    --outdir    | -o <dir>   Write each configuration to <dir>/<i>.rc instead\n"
+            "    --compact   | -C         Fold the journal of the configuration into a new snapshot\n"
+            "    --serve     | -D <sock>  Keep the configuration loaded and serve requests on <sock>\n"
+            "    --interval  | -i <secs>  Seconds between snapshots while serving (default 60)\n"
+            "    --connect   | -c <sock>  Send the request to the server on <sock> instead\n"
+            "    --lease     | -t <secs>  Lease the configurations to this worker for <secs>\n"
+            "    --worker    | -w <name>  Worker name for --lease and --done (default hostname)\n"
+            "    --done      | -d         Release all configurations leased to this worker\n"
+            "    --jobs      | -j <n>     Threads to penalize configurations with (default all cores)\n"
         );
         exit(1);
     }
-    FILE* fp = fopen(ca.l[0], "rb");
-    if (!fp) {
-        fprintf(stderr, "File not found or not readable: %s\n", ca.l[0]);
-        exit(1);
+    size_t count = 1;
+    if (ca.m.count('n')) {
+        char* end;
+        count = strtoul(ca.m['n'].c_str(), &end, 10);
+        if (*end || count == 0) {
+            fprintf(stderr, "Invalid count: %s\n", ca.m['n'].c_str());
+            exit(1);
+        }
     }
-    wc::wc wc(fp);
-    fclose(fp);
-    if (ca.m.count('l')) {
-        printf(" #  |    PRI   |    PEN   | CONFIG\n");
-        size_t idx = wc.configurations->size();
-        for (auto& c : *wc.configurations) { idx--; printf("%3zu | %8.5f | %8.5f | %s\n", idx, c->pri, c->last_penalty, c->to_string().c_str()); }
-    } else if (ca.m.count('s')) {
-        sb fmt, res, occ, inc, pri;
-        fmt += ' '; res += ' '; occ += ' '; inc += ' '; pri += ' ';
-        printf(" ");
-        for (auto& o : wc.options) {
-            size_t minwidth = 1 + o->name.length();
-            size_t optlen = 0;
-            for (auto& s : o->settings) {
-                size_t slen = std::max<size_t>({3, s->value.length(), std::to_string(s->inclusions).length(), std::to_string(s->occurrences).length()});
-                std::string f = "%-" + std::to_string(slen) + "s ";
-                fmt += strprintf(f, s->value);
-                f = "%-" + std::to_string(slen) + "zu ";
-                optlen += slen + 1;
-                size_t r = s->occurrences ? (100 * s->inclusions) / s->occurrences : 100;
-                res += strprintf(f, r);
-                occ += strprintf(f, s->occurrences);
-                inc += strprintf(f, s->inclusions);
-                f = "%-" + std::to_string(slen) + "d ";
-                pri += strprintf(f, s->priority);
-            }
-            if (minwidth > optlen) {
-                std::string f = "%" + std::to_string(minwidth - optlen) + "s";
-                fmt += strprintf(f, "");
-                res += strprintf(f, "");
-                occ += strprintf(f, "");
-                inc += strprintf(f, "");
-                pri += strprintf(f, "");
+    std::string separator = ca.m.count('S') ? ca.m['S'] : "---";
+    size_t top = SIZE_MAX;
+    if (ca.m.count('k')) {
+        char* end;
+        top = strtoul(ca.m['k'].c_str(), &end, 10);
+        if (*end || top == 0) {
+            fprintf(stderr, "Invalid top: %s\n", ca.m['k'].c_str());
+            exit(1);
+        }
+        // only ever a listing, never an emission
+        ca.m['l'] = "";
+    }
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    if (ca.m.count('j')) {
+        char* end;
+        threads = strtoul(ca.m['j'].c_str(), &end, 10);
+        if (*end || threads == 0) {
+            fprintf(stderr, "Invalid thread count: %s\n", ca.m['j'].c_str());
+            exit(1);
+        }
+    }
+    if (ca.m.count('c')) {
+        if (ca.m.count('o') || ca.m.count('C')) {
+            fprintf(stderr, "--outdir and --compact cannot be used with --connect\n");
+            exit(1);
+        }
+        const char* socket_path = ca.m['c'].c_str();
+        if (ca.m.count('l')) return request(socket_path, top == SIZE_MAX ? "list" : strprintf("list %zu", top));
+        if (ca.m.count('s')) return request(socket_path, "stats");
+        if (ca.m.count('r')) return request(socket_path, "report");
+        return request(socket_path, strprintf("next %zu %s", count, separator));
+    }
+    if (ca.m.count('D')) {
+        unsigned interval = 60;
+        if (ca.m.count('i')) {
+            char* end;
+            interval = strtoul(ca.m['i'].c_str(), &end, 10);
+            if (*end || interval == 0) {
+                fprintf(stderr, "Invalid interval: %s\n", ca.m['i'].c_str());
+                exit(1);
             }
-            minwidth = std::max(minwidth, optlen);
-            fputs((c(o->name, minwidth) + " ").c_str(), stdout);
-            fmt += ' '; res += ' '; occ += ' '; inc += ' '; pri += ' ';
         }
-        printf("\n%s\n%s (%%)\n%s (priority)\n%s (count)\n%s (total)\n", fmt.c_str(), res.c_str(), pri.c_str(), inc.c_str(), occ.c_str());
+        serve(ca.l[0], ca.m['D'].c_str(), interval, threads);
+        exit(0);
+    }
+    std::string worker;
+    if (ca.m.count('w')) {
+        worker = ca.m['w'];
     } else {
-        if (!wc.emit_and_penalize(stdout)) {
+        char host[256] = "";
+        gethostname(host, sizeof(host) - 1);
+        worker = host;
+    }
+    if (worker.empty() || worker.find_first_of(" \t\n") != std::string::npos) {
+        fprintf(stderr, "Invalid worker name: %s\n", worker.c_str());
+        exit(1);
+    }
+    unsigned lease_secs = 0;
+    if (ca.m.count('t')) {
+        char* end;
+        lease_secs = strtoul(ca.m['t'].c_str(), &end, 10);
+        if (*end || lease_secs == 0) {
+            fprintf(stderr, "Invalid lease: %s\n", ca.m['t'].c_str());
             exit(1);
         }
-        fp = fopen(argv[1], "wb");
-        wc.save(fp);
-        fclose(fp);
+    }
+    // emitting updates the instance, in place if it is a v2 file
+    bool emitting = ca.m.count('C') || (!ca.m.count('l') && !ca.m.count('s') && !ca.m.count('r'));
+    if (emitting && ca.m.count('o')) {
+        struct stat st;
+        const char* outdir = ca.m['o'].c_str();
+        if (stat(outdir, &st) || !S_ISDIR(st.st_mode) || access(outdir, W_OK | X_OK)) {
+            fprintf(stderr, "Not a writable directory: %s\n", outdir);
+            exit(1);
+        }
+    }
+    instance_lock lock(ca.l[0], emitting || ca.m.count('d'));
+    if (ca.m.count('d')) {
+        std::vector<lease> leases = load_leases(ca.l[0]);
+        size_t before = leases.size();
+        leases.erase(std::remove_if(leases.begin(), leases.end(), [&](const lease& l) { return l.worker == worker; }), leases.end());
+        if (leases.size() == before) exit(1);
+        save_leases(ca.l[0], leases);
         exit(0);
     }
+    FILE* fp = fopen(ca.l[0], emitting ? "r+b" : "rb");
+    if (!fp) {
+        fprintf(stderr, "File not found or not %s: %s\n", emitting ? "writable" : "readable", ca.l[0]);
+        exit(1);
+    }
+    wc::wc wc(fp, emitting);
+    wc.threads = threads;
+    if (!emitting) fclose(fp);
+    if (ca.m.count('C')) {
+        wc.compact(ca.l[0]);
+        fclose(fp);
+    } else if (ca.m.count('l')) {
+        print_list(wc, stdout, top);
+    } else if (ca.m.count('s')) {
+        print_stats(wc, stdout);
+    } else if (ca.m.count('r')) {
+        print_report(wc, stdout);
+    } else {
+        // configurations whose lease has run out are handed out again first
+        std::vector<lease> leases = load_leases(ca.l[0]);
+        time_t now = time(nullptr);
+        auto next = [&](wc::sidx_t* row) {
+            for (size_t i = 0; i < leases.size(); ++i) {
+                if (leases[i].expires > now) continue;
+                wc.decode(leases[i].id, row);
+                if (lease_secs) {
+                    leases[i].expires = now + lease_secs;
+                    leases[i].worker = worker;
+                } else {
+                    leases.erase(leases.begin() + i);
+                }
+                return true;
+            }
+            if (!wc.take(row)) return false;
+            if (lease_secs) leases.push_back({wc.id_of(row), now + lease_secs, worker});
+            return true;
+        };
+        bool failed = false;
+        size_t emitted = emit_batch(wc, count, separator, ca.m.count('o') ? ca.m['o'].c_str() : nullptr, stdout, next, &failed);
+        if (emitted) {
+            wc.store(fp);
+            if (wc.needs_compaction()) wc.compact(ca.l[0]);
+            save_leases(ca.l[0], leases);
+        }
+        fclose(fp);
+        exit(emitted && !failed ? 0 : 1);
+    }
 }